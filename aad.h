@@ -0,0 +1,159 @@
+#pragma once
+#include <array>
+#include <cmath>  // std::exp
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+struct Number;
+
+/*
+    A lightweight reverse-mode automatic differentiation (AAD) tape.
+
+    Every arithmetic operation on a Number records a node on the active Tape
+    holding the local partial derivatives with respect to its (at most two)
+    arguments. One backward sweep over the tape then propagates the adjoint
+    of the result to every input, so the full gradient of a valuation costs a
+    small constant multiple of the valuation itself however many inputs there
+    are. Constants (plain doubles promoted to Number) are never recorded.
+
+    Nodes are stored in an arena of fixed-size blocks. rewind() keeps the
+    blocks, so repeated valuations do not allocate, and recorded nodes never
+    move (unlike a std::vector that reallocates as it grows).
+
+    Usage:
+        Tape tape;                        // becomes the active tape
+        Number x = tape.new_variable(2.0);
+        Number y = x * exp(x);
+        tape.backward(y);
+        tape.get_adjoint(x);              // dy/dx
+*/
+struct Tape {
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    Tape() { active = this; }
+    ~Tape() {
+        if (active == this) active = nullptr;
+    }
+    Tape(const Tape&) = delete;
+    Tape& operator=(const Tape&) = delete;
+
+    // The tape that operations on Numbers record onto (one per thread)
+    static Tape* get_active() { return active; }
+    void activate() { active = this; }
+
+    // RETURNS the index of a new node with the given parents and partials
+    size_t record(size_t parent_1, double partial_1, size_t parent_2 = npos,
+                  double partial_2 = 0.0) {
+        if (size == blocks.size() * BLOCK_SIZE) {
+            blocks.push_back(std::make_unique<Node[]>(BLOCK_SIZE));
+        }
+        blocks[size / BLOCK_SIZE][size % BLOCK_SIZE] = {
+            {parent_1, parent_2}, {partial_1, partial_2}};
+        return size++;
+    }
+
+    // Leaves of the graph are recorded as nodes without parents
+    size_t record_leaf() { return record(npos, 0.0); }
+
+    // Seeds d(result)/d(result) = 1 and sweeps the tape backwards
+    void backward(const Number& result);
+    void backward(size_t result_node) {
+        adjoints.assign(size, 0.0);
+        if (result_node == npos) return;
+        adjoints[result_node] = 1.0;
+        for (size_t i = result_node + 1; i-- > 0;) {
+            double adjoint{adjoints[i]};
+            if (adjoint == 0.0) continue;
+            const Node& n = blocks[i / BLOCK_SIZE][i % BLOCK_SIZE];
+            for (size_t k = 0; k < 2; ++k) {
+                if (n.parents[k] != npos) {
+                    adjoints[n.parents[k]] += adjoint * n.partials[k];
+                }
+            }
+        }
+    }
+
+    // REQUIRES backward() to have been called after x was recorded
+    double get_adjoint(const Number& x) const;
+
+    // An input to differentiate with respect to
+    Number new_variable(double value);
+
+    // Forget all nodes but keep the arena for the next recording
+    void rewind() {
+        size = 0;
+        adjoints.clear();
+    }
+
+    size_t get_size() const { return size; }
+
+   private:
+    struct Node {
+        std::array<size_t, 2> parents;
+        std::array<double, 2> partials;
+    };
+    static constexpr size_t BLOCK_SIZE{1 << 14};
+    static inline thread_local Tape* active = nullptr;
+
+    std::vector<std::unique_ptr<Node[]>> blocks;
+    size_t size{0};
+    std::vector<double> adjoints;
+};
+
+/* A double that records the operations applied to it on the active Tape */
+struct Number {
+    Number(double v = 0.0) : value{v} {}  // a constant, not on the tape
+    Number(double v, size_t n) : value{v}, node{n} {}
+
+    Number& operator+=(const Number& rhs) { return *this = *this + rhs; }
+    Number& operator-=(const Number& rhs) { return *this = *this - rhs; }
+    Number& operator*=(const Number& rhs) { return *this = *this * rhs; }
+
+    friend Number operator+(const Number& a, const Number& b) {
+        return binary(a.value + b.value, a, 1.0, b, 1.0);
+    }
+    friend Number operator-(const Number& a, const Number& b) {
+        return binary(a.value - b.value, a, 1.0, b, -1.0);
+    }
+    friend Number operator*(const Number& a, const Number& b) {
+        return binary(a.value * b.value, a, b.value, b, a.value);
+    }
+    friend Number operator/(const Number& a, const Number& b) {
+        double q{a.value / b.value};
+        return binary(q, a, 1.0 / b.value, b, -q / b.value);
+    }
+    friend Number operator-(const Number& a) {
+        return binary(-a.value, a, -1.0, Number{}, 0.0);
+    }
+    friend Number exp(const Number& a) {
+        double e{std::exp(a.value)};
+        return binary(e, a, e, Number{}, 0.0);
+    }
+
+    double value;
+    size_t node{Tape::npos};
+
+   private:
+    // Records the result of f(a, b) with partials df/da, df/db if either
+    // argument is on the tape, otherwise the result is a constant too
+    static Number binary(double value, const Number& a, double da,
+                         const Number& b, double db) {
+        if (a.node == Tape::npos && b.node == Tape::npos) return {value};
+        if (a.node == Tape::npos) {
+            return {value, Tape::get_active()->record(b.node, db)};
+        }
+        if (b.node == Tape::npos) {
+            return {value, Tape::get_active()->record(a.node, da)};
+        }
+        return {value, Tape::get_active()->record(a.node, da, b.node, db)};
+    }
+};
+
+inline void Tape::backward(const Number& result) { backward(result.node); }
+inline double Tape::get_adjoint(const Number& x) const {
+    return x.node == npos ? 0.0 : adjoints[x.node];
+}
+inline Number Tape::new_variable(double value) {
+    return {value, record_leaf()};
+}
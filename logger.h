@@ -45,6 +45,11 @@ struct Log {
         make_red(err_stream);
         err_stream << "No spot for " << ccy_string << "\n";
     }
+    static void warn_bump_size(double size) {
+        make_red(err_stream);
+        err_stream << "Bump size " << size
+                   << " must be positive and finite.\n";
+    }
 
     static void info_rate(const std::string& line) {
         make_yellow(out_stream);
@@ -90,13 +95,138 @@ struct Log {
     }
     static void info_DV01(const std::string& ccy_string, int tenor) {
         make_green(out_stream);
-        out_stream << "Calculating DV01 with central differences for "
-                   << ccy_string << " and a bump to tenor = " << tenor << "\n";
+        out_stream << "Calculating DV01 by bump and revalue for " << ccy_string
+                   << " and a bump to tenor = " << tenor << "\n";
     }
     static void info_DV01(const std::string& ccy_string) {
         make_green(out_stream);
-        out_stream << "Calculating DV01 with central differences for "
-                   << ccy_string << " and a parallel curve shift\n";
+        out_stream << "Calculating DV01 by bump and revalue for " << ccy_string
+                   << " and a parallel curve shift\n";
+    }
+    static void info_DV01_ladder(const std::string& ccy_string,
+                                 bool analytic) {
+        make_green(out_stream);
+        out_stream << "Calculating DV01 ladder with "
+                   << (analytic ? "analytic derivatives"
+                                : "central differences")
+                   << " for " << ccy_string << " in one pass over the trades\n";
+    }
+    static void info_DV01_ladders(size_t n_ccys, size_t n_threads) {
+        make_green(out_stream);
+        out_stream << "Calculating DV01 ladders with central differences for "
+                   << n_ccys << " currencies on " << n_threads << " threads\n";
+    }
+    static void info_gamma(const std::string& ccy_string) {
+        make_green(out_stream);
+        out_stream << "Calculating the cross-gamma matrix for " << ccy_string
+                   << "\n";
+    }
+    static void info_FX_delta() {
+        make_green(out_stream);
+        out_stream << "Calculating FX delta for all spots\n";
+    }
+    static void info_bump_spot(double bump_amount) {
+        make_green(out_stream);
+        out_stream << "Bumping FX spot by " << bump_amount * 100 << "%\n";
+    }
+    static void info_unbump_spot(double bump_amount) {
+        make_green(out_stream);
+        out_stream << "Unbumping FX spot by " << bump_amount * 100 << "%\n";
+    }
+    static void info_history(size_t days, size_t factors) {
+        make_green(out_stream);
+        out_stream << "Loaded " << days << " days of history for " << factors
+                   << " risk factors\n";
+    }
+    static void info_historical_VaR(double confidence, size_t window) {
+        make_green(out_stream);
+        out_stream << "Calculating " << confidence * 100
+                   << "% historical VaR over " << window << " days\n";
+    }
+    static void info_MC_VaR(double confidence, size_t n_paths) {
+        make_green(out_stream);
+        out_stream << "Calculating " << confidence * 100
+                   << "% Monte Carlo VaR over " << n_paths << " paths\n";
+    }
+    static void info_stresses(size_t n_stresses) {
+        make_green(out_stream);
+        out_stream << "Running " << n_stresses
+                   << " stress scenarios on all currencies\n";
+    }
+    static void info_parametric_VaR(double confidence) {
+        make_green(out_stream);
+        out_stream << "Calculating " << confidence * 100
+                   << "% delta-normal VaR from sensitivities\n";
+    }
+    static void info_MC_tail_stats(size_t n_paths) {
+        make_green(out_stream);
+        out_stream << "Simulating the Monte Carlo loss distribution over "
+                   << n_paths << " paths\n";
+    }
+    static void info_theta(int days, size_t n_ccys) {
+        make_green(out_stream);
+        out_stream << "Calculating " << days << "-day theta and carry for "
+                   << n_ccys << " currencies\n";
+    }
+    static void info_PnL_explain(const std::string& from_path,
+                                 const std::string& to_path) {
+        make_green(out_stream);
+        out_stream << "Explaining the P&L from " << from_path << " to "
+                   << to_path << "\n";
+    }
+    static void info_par_DV01_ladder(const std::string& ccy_string) {
+        make_green(out_stream);
+        out_stream << "Calculating the par-rate DV01 ladder for " << ccy_string
+                   << "\n";
+    }
+    static void info_bucketed_DV01_ladder(const std::string& ccy_string,
+                                          size_t n_buckets) {
+        make_green(out_stream);
+        out_stream << "Calculating the DV01 ladder for " << ccy_string
+                   << " on " << n_buckets << " standard buckets\n";
+    }
+    static void info_live_risk(const std::string& ccy_string) {
+        make_green(out_stream);
+        out_stream << "Fetching live PV and DV01 ladder for " << ccy_string
+                   << "\n";
+    }
+    static void info_queries(size_t n_queries, size_t n_unique, size_t n_ccys) {
+        make_green(out_stream);
+        out_stream << "Answering " << n_queries << " risk queries (" << n_unique
+                   << " distinct) for " << n_ccys << " currencies\n";
+    }
+    static void info_limit(const std::string& ccy_string, int tenor,
+                           double limit) {
+        make_green(out_stream);
+        out_stream << "Setting a limit of " << limit << " on the "
+                   << (tenor < 0 ? "PV"
+                                 : "DV01 to tenor " + std::to_string(tenor))
+                   << " of " << ccy_string << "\n";
+    }
+    static void info_convexity(size_t n_shifts) {
+        make_green(out_stream);
+        out_stream << "Calculating the PV change for " << n_shifts
+                   << " parallel shifts of every curve\n";
+    }
+    static void info_exposure(int step, int end) {
+        make_green(out_stream);
+        out_stream << "Calculating the exposure profile every " << step
+                   << " days up to " << end << " days\n";
+    }
+    static void info_cash_ladders(size_t n_widths) {
+        make_green(out_stream);
+        out_stream << "Calculating cash ladders with " << n_widths
+                   << " bucket widths\n";
+    }
+    static void info_threads(size_t n_threads, bool pinned) {
+        make_green(out_stream);
+        out_stream << "Running parallel jobs on " << n_threads
+                   << (pinned ? " pinned" : "") << " threads\n";
+    }
+    static void info_PV_gradient() {
+        make_green(out_stream);
+        out_stream << "Calculating the PV gradient to all curve nodes and FX "
+                      "spots with AAD\n";
     }
     static void info_bump_tenor(int tenor, double bump_amount) {
         make_green(out_stream);
@@ -136,6 +266,10 @@ struct Log {
         make_blue(std::cout);
         std::cout << name << "\n";
     }
+    static void print_test_check(bool passed) {
+        make_blue(std::cout);
+        std::cout << (passed ? "passed" : "\033[31mFAILED\033[0m") << "\n";
+    }
     static void print_test_double(double value) {
         make_blue(std::cout);
         std::cout << value << "\n";
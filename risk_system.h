@@ -6,10 +6,38 @@
     - Calculate with finite difference the PV01 of a portfolio with respect to
         - a bump on one tenor in the yield curve of the portfolio's currency
         - a uniform shift of the whole curve
-        * the two functions take in a currency and return the impact on
-   positions in that currency converted into USD (by default)
+        - a bump on each tenor in turn (a DV01 ladder), in one pass
+        - a bump on the par rate of the hedging instrument at each tenor
+        - a bump on each bucket of a standard (SIMM-style) key-rate grid
+        * bumps are central by default, or forward, backward or relative
+          with any size (see BumpScheme)
+        * the functions take in a currency and return the impact on
+   positions in that currency converted into USD (by default, see
+   set_reporting_currency) through a matrix of FX crosses
         * positions are just cash flow notionals by dates (see portfolio.txt)
-    - (TODO) Repeat the process with FX spot rates to determine the fx delta
+    - Find exact sensitivities analytically or with AAD (see aad.h)
+    - Run bump-and-revalue jobs for many currencies on a thread pool
+    - Share one owned, work-stealing thread pool (see thread_pool.h) between
+      trade-line parsing, valuation, ladder and scenario engines, with a
+      configurable number of (optionally pinned) workers; market files are
+      still read serially
+    - Answer batches of DF, DV01 and PV queries, deduplicated and grouped by
+      currency
+    - Calculate the cross-gamma matrix of the tenors of a curve, and the PV
+      change for parallel shifts from 1bp to 200bp in one pass
+    - Repeat the process with FX spot rates to determine the fx delta
+    - Calculate 1-day theta and carry by rolling the valuation date
+    - Explain the P&L between two market snapshots with rate, FX and time risk
+    - Project the expected PV of each book at monthly horizons to 30 years
+    - Bucket each book's cashflows into daily, weekly and monthly cash ladders
+    - Calculate historical-simulation, Monte Carlo and delta-normal VaR and
+      expected shortfall, at many confidence levels with mergeable tail
+      statistics (see tail_stats.h)
+    - Run a library of stress scenarios (see stresses.txt) in one batch
+    - Update rates, spots and trades in place, with DV01 results cached until
+      one of their inputs changes, and live PVs and ladders that a rate tick
+      only revalues next to its curve node, checked against DV01 and PV
+      limits after every update
     - (TODO) Handle 'FX Forward' trades (see ref pdf and data in portfolio2.txt)
 
     All ref data is found in risk_system_ref/ and comes from NUS FE5226 (see
@@ -46,12 +74,15 @@
 #include <iostream>
 #include <optional>
 #include <regex>
+#include <span>
 #include <sstream>
 #include <string>
 #include <type_traits>
 #include <vector>
 
 #include "risk_system_structs.h"  // already includes logger.h
+#include "tail_stats.h"
+#include "thread_pool.h"
 
 // Definitions are placed in the header file as suggested by
 // https://isocpp.org/wiki/faq/templates#separate-template-fn-defn-from-decl
@@ -62,37 +93,20 @@ class RiskManagementSystem {
    public:
     // using enum G5::Currency; // error: template arguments are dependent types
 
+    // Parallel engines all run on one owned pool of n_threads workers,
+    // optionally pinned to cores (see thread_pool.h and set_threads)
     RiskManagementSystem(const std::string& rates_path,
-                         const std::string& portfolio_path) {
+                         const std::string& portfolio_path,
+                         size_t n_threads = std::thread::hardware_concurrency(),
+                         bool pin = false)
+        : pool{std::make_unique<ThreadPool>(n_threads, pin)} {
         std::ifstream in_rates{rates_path}, in_portfolio{portfolio_path};
         if (!check_data(in_rates, rates_path) ||
             !check_data(in_portfolio, portfolio_path)) {
             throw "Check file paths?";
         }
-        std::string line;
-        std::getline(in_rates, line);  // discard the first line starting with #
-
-        // e.g. IR.2W.EUR 0.025 (with thanks to https://regex101.com/)
-        std::regex rates_format{
-            R"(^IR\.[[:digit:]]+[[:upper:]]\.[[:upper:]]{3}[[:blank:]](?:[[:digit:]]+\.)?[[:digit:]]+$)"};
-
-        // e.g. FX.SPOT.EUR 1.1213 (always XXXUSD)
-        std::regex fx_format{
-            R"(^FX\.SPOT\.[[:upper:]]{3}[[:blank:]](?:[[:digit:]]+\.)?[[:digit:]]+$)"};
-
-        // https://stackoverflow.com/questions/36213659/how-to-sscanf-in-c
-        while (std::getline(in_rates, line)) {
-            if (std::regex_search(line, rates_format)) {
-                parse_rate(line);
-                continue;
-            }
-
-            if (std::regex_search(line, fx_format)) {
-                parse_fx(line);
-                continue;
-            }
-            Log::warn_line(line);
-        }
+        load_market(in_rates, currency_rates, currency_spot);
+        fx_matrix.refresh(currency_spot);
 
 #ifdef DEBUG
         using namespace std::chrono;  // just for next two lines
@@ -104,19 +118,36 @@ class RiskManagementSystem {
         Log::info_delta(delta);
 #endif
         delta = 42940;  // strategically overriden to match the portfolio dates
+        std::string line;
         std::getline(in_portfolio, line);  // discard first line starting with #
 
-        std::regex trade_format{
-            R"(^[[:digit:]]+;[a-f0-9]{8};[[:upper:]]{3};[[:digit:]]{5};$)"};
+        std::vector<std::string> lines;
         while (std::getline(in_portfolio, line)) {
-            if (std::regex_search(line, trade_format)) {
-                parse_trade(line);
+            lines.push_back(std::move(line));
+        }
+
+        // Each line is matched and parsed on the pool; the parsed trades are
+        // then logged and booked in file order
+        auto trades = pool->parallel_map(
+            lines.size(), [&lines](size_t i) { return read_trade(lines[i]); });
+        for (size_t i = 0; i < lines.size(); ++i) {
+            if (!trades[i]) {
+                Log::warn_line(lines[i]);
                 continue;
             }
-            Log::warn_line(line);
+            book_trade(lines[i], *trades[i]);
         }
     }
 
+    // Replace the pool with one of n_threads workers, pinned to cores if pin
+    // (and the platform allows it). Results never depend on the pool size.
+    void set_threads(size_t n_threads, bool pin = false) {
+        pool = std::make_unique<ThreadPool>(n_threads, pin);
+        Log::info_threads(pool->size(), pool->is_pinned());
+    }
+
+    size_t get_threads() const { return pool->size(); }
+
     // Return an owning container rather than a non-owning view
     std::vector<int> get_maturities(CcyGroup::Currency ccy) {
         if (!check_maturities(ccy)) return {};
@@ -164,52 +195,1138 @@ class RiskManagementSystem {
                                   currency_spot.at(term));
     }
 
+    // Market and portfolio updates. Each one moves the version of the data it
+    // touches, so cached results are recomputed exactly when an input changed
+    void add_rate(CcyGroup::Currency ccy, int tenor, double rate) {
+        if (!check_tenor_val(tenor)) return;
+        auto& curve = currency_rates[ccy];
+        bool new_node{!curve.check_tenor(tenor)};
+        curve.add_rate(tenor, rate);
+        ++curve_versions[ccy];
+        if (auto it = live_books.find(ccy); it != live_books.end()) {
+            if (new_node) {
+                live_books.erase(it);  // the segments move: rebuild when asked
+            } else {
+                const auto& tenors = it->second.get_grid().tenors;
+                it->second.set_rate(std::ranges::lower_bound(tenors, tenor) -
+                                        tenors.begin(),
+                                    rate);
+            }
+        }
+        update_parametric_VaR(ccy);
+        check_limits(ccy);
+    }
+    void set_spot(CcyGroup::Currency ccy, double spot) {
+        currency_spot[ccy].set_spot(spot);
+        fx_matrix.refresh(currency_spot);
+        ++spot_versions[ccy];
+        if (ccy == CcyGroup::Currency::USD) {
+            // every book's USD value moves with the numeraire
+            for (auto& [blocked, _] : parametric_blocks) {
+                update_parametric_VaR(blocked);
+            }
+        } else {
+            update_parametric_VaR(ccy);
+        }
+        if (ccy != reporting_ccy) {
+            check_limits(ccy);
+            return;
+        }
+        for (auto& [limited, _] : limits) check_limits(limited);
+    }
+    // payment_date in days since the (Excel) 1900 epoch, as in portfolio.txt
+    void add_trade(CcyGroup::Currency ccy, int payment_date, int notional) {
+        if (!check_tenor_val(payment_date - delta)) return;
+        if (!currency_notionals.contains(ccy)) {
+            // default construct DateNotionals object
+            currency_notionals[ccy].set_delta(delta);
+        }
+        currency_notionals.at(ccy).add_trade(payment_date, notional);
+        ++book_versions[ccy];
+        if (auto it = live_books.find(ccy); it != live_books.end()) {
+            it->second.add_cashflow(payment_date - delta, notional);
+        }
+        update_parametric_VaR(ccy);
+        check_limits(ccy);
+    }
+
+    // Report sensitivities (DV01s, ladders, gamma, theta) in ccy rather than
+    // USD. Scenario P&L (VaR, stresses, P&L explain) and FX deltas stay in
+    // USD, the numeraire of the XXXUSD spots they move.
+    void set_reporting_currency(CcyGroup::Currency ccy) {
+        if (!check_fx(ccy)) return;
+        reporting_ccy = ccy;
+        DV01_cache.clear();  // the FX versions now cover another spot
+    }
+    CcyGroup::Currency get_reporting_currency() const { return reporting_ccy; }
+
+    // Get the book PV of every currency with rates and trades in the
+    // reporting currency, converted in one multiply by the FX matrix
+    std::map<typename CcyGroup::Currency, double> get_book_values() {
+        typename FXMatrix<CcyGroup>::Amounts pvs{};
+        for (auto& [ccy, trades] : currency_notionals) {
+            if (!currency_rates.contains(ccy)) continue;
+            pvs[FXMatrix<CcyGroup>::index(ccy)] = get_book_value(ccy).value();
+        }
+        auto converted = fx_matrix.convert(pvs, reporting_ccy);
+        std::map<typename CcyGroup::Currency, double> values;
+        for (auto& [ccy, trades] : currency_notionals) {
+            if (!currency_rates.contains(ccy)) continue;
+            values.emplace(ccy, converted[FXMatrix<CcyGroup>::index(ccy)]);
+        }
+        return values;
+    }
+
+    // PV and analytic DV01 ladder in the reporting ccy, kept live
+    struct LiveRisk {
+        double PV{0.0};
+        std::map<int, double> ladder;
+    };
+
+    // Get the live risk of the book in ccy. Its PV and ladder are kept per
+    // segment of the curve (see IncrementalBook): a rate tick from add_rate
+    // revalues only the cashflows next to its node, a spot tick only moves
+    // the conversion, a new trade only revalues the cashflows next to it,
+    // and a new node rebuilds this currency alone.
+    std::optional<LiveRisk> get_live_risk(CcyGroup::Currency ccy) {
+        if (!check_rates(ccy) || !check_fx(ccy)) return {};
+        Log::info_live_risk(CcyGroup::to_string(ccy));
+        const auto& book = get_live_book(ccy);
+        double fx{get_reporting_conversion(ccy)};
+        LiveRisk risk{fx * book.get_book_value(), {}};
+        auto ladder = book.get_ladder();
+        for (size_t i = 0; i < ladder.size(); ++i) {
+            risk.ladder.emplace(book.get_grid().tenors[i], fx * ladder[i]);
+        }
+        return std::make_optional(std::move(risk));
+    }
+
+    // A breach of the limit on the absolute PV (tenor PV_LIMIT) or DV01 to
+    // one curve node of ccy, in the reporting ccy
+    struct LimitBreach {
+        typename CcyGroup::Currency ccy;
+        int tenor;
+        double value, limit;
+    };
+    static constexpr int PV_LIMIT{-1};
+
+    // Breaches found after any update are sent to callback
+    void set_limit_callback(std::function<void(const LimitBreach&)> callback) {
+        on_breach = std::move(callback);
+    }
+
+    // Limits apply to the live risk (see get_live_risk) and are checked after
+    // every rate, spot or trade update of the currency
+    bool set_PV_limit(CcyGroup::Currency ccy, double limit) {
+        if (!check_rates(ccy) || !check_fx(ccy)) return false;
+        return set_limit(ccy, PV_LIMIT, limit);
+    }
+    bool set_DV01_limit(CcyGroup::Currency ccy, int tenor, double limit) {
+        if (!check_tenor_rate(ccy, tenor) || !check_fx(ccy)) return false;
+        return set_limit(ccy, tenor, limit);
+    }
+
+    // Check the limits of ccy against its live risk, with one vectorized
+    // comparison and no allocation unless the curve gained nodes since the
+    // last check. RETURNS the number of breaches
+    size_t check_limits(CcyGroup::Currency ccy) {
+        auto it = limits.find(ccy);
+        if (it == limits.end() || !currency_rates.contains(ccy) ||
+            !currency_spot.contains(ccy)) {
+            return 0;
+        }
+        auto& limit = it->second;
+        const auto& book = get_live_book(ccy);
+        const auto& tenors = book.get_grid().tenors;
+        if (limit.tenors.size() != tenors.size() + 1 ||
+            !std::ranges::equal(tenors, limit.tenors | std::views::drop(1))) {
+            set_limit_slots(limit, tenors);
+        }
+        book.get_risk(limit.values.data());
+        double fx{get_reporting_conversion(ccy)};
+        for (double& value : limit.values) value *= fx;
+        return limit.book.check(
+            limit.values.data(), [this, ccy, &limit](size_t i, double value,
+                                                     double threshold) {
+                if (on_breach) {
+                    on_breach({ccy, limit.tenors[i], value, threshold});
+                }
+            });
+    }
+
     // Get the DV01 in the desired ccy by bumping only one tenor
-    std::optional<double> get_DV01(CcyGroup::Currency ccy, int tenor) {
-        if (!check_tenor_rate(ccy, tenor) || !check_fx(ccy)) return {};
+    std::optional<double> get_DV01(
+        CcyGroup::Currency ccy, int tenor,
+        SensitivityMethod method = SensitivityMethod::CentralDifference,
+        const BumpScheme& scheme = {}) {
+        if (!check_tenor_rate(ccy, tenor) || !check_fx(ccy) ||
+            !check_bump_scheme(scheme)) {
+            return {};
+        }
+        DV01Query query{ccy, tenor, method, scheme};
+        if (auto cached = get_cached_DV01(query)) return cached;
+        if (method == SensitivityMethod::Analytic) {
+            return cache_DV01(query, get_DV01_ladder(ccy, method)->at(tenor));
+        }
         Log::info_DV01(CcyGroup::to_string(ccy), tenor);
+        return cache_DV01(query, get_bumped_DV01(ccy, tenor, scheme));
+    }
 
-        auto& rates = currency_rates.at(ccy);
-        auto& trades = currency_notionals.at(ccy);
+    // Get the DV01 in the desired ccy by bumping the entire curve
+    std::optional<double> get_DV01(
+        CcyGroup::Currency ccy,
+        SensitivityMethod method = SensitivityMethod::CentralDifference,
+        const BumpScheme& scheme = {}) {
+        if (!check_rates(ccy) || !check_fx(ccy) ||
+            !check_bump_scheme(scheme)) {
+            return {};
+        }
+        DV01Query query{ccy, {}, method, scheme};
+        if (auto cached = get_cached_DV01(query)) return cached;
+        if (method == SensitivityMethod::Analytic) {
+            // a parallel shift moves every node, so its DV01 is the ladder sum
+            auto ladder = get_DV01_ladder(ccy, method).value();
+            auto v = std::views::values(ladder);
+            return cache_DV01(query, std::reduce(v.begin(), v.end()));
+        }
+        Log::info_DV01(CcyGroup::to_string(ccy));
+        return cache_DV01(query, get_bumped_DV01(ccy, {}, scheme));
+    }
 
-        // bump the curve in its own scope so it gets unbumped when we exit
-        auto get_bumped_value = [&rates, &trades, &tenor](double bump) {
-            auto unbump_later = rates.bump_tenor(tenor, bump);
-            auto discount_fn = [&rates](int tenor) {
-                return rates.get_discount_factor(tenor);
+    // Get the DV01 to every tenor of the curve at once. With central
+    // differences this is the same calculation as get_DV01(ccy, tenor), but a
+    // bump to one tenor only moves the cashflows whose rate is interpolated
+    // from it, so one sweep over the sorted cashflows revalues each of them
+    // against (at most) its two neighbouring nodes instead of revaluing the
+    // book twice per tenor. Analytic mode differentiates the interpolation:
+    // d/dr_i exp(-r_t * t / 360) = -w_i * t / 360 * exp(-r_t * t / 360).
+    std::optional<std::map<int, double>> get_DV01_ladder(
+        CcyGroup::Currency ccy,
+        SensitivityMethod method = SensitivityMethod::CentralDifference) {
+        if (!check_rates(ccy) || !check_fx(ccy)) return {};
+        Log::info_DV01_ladder(CcyGroup::to_string(ccy),
+                              method == SensitivityMethod::Analytic);
+
+        CashflowGrid grid{get_grid(ccy)};
+        size_t n{grid.tenors.size()};
+        auto ladder = get_ladder(grid, method, get_node_allocation(n), n);
+
+        // Convert sensitivities to local rates to the reporting ccy
+        double fx{get_reporting_conversion(ccy)};
+        std::map<int, double> result;
+        for (size_t i = 0; i < ladder.size(); ++i) {
+            result.emplace(grid.tenors[i], fx * ladder[i]);
+        }
+        return std::make_optional(std::move(result));
+    }
+
+    // Set the standard buckets of get_bucketed_DV01_ladder, e.g. {14, 30, 90}
+    void set_key_rate_buckets(std::vector<int> tenors) {
+        std::ranges::sort(tenors);
+        auto [first, last] = std::ranges::unique(tenors);
+        tenors.erase(first, last);
+        if (tenors.empty() || !check_tenor_val(tenors.front())) return;
+        key_rate_buckets.tenors = std::move(tenors);
+        key_rate_allocations.clear();
+    }
+
+    // Get the DV01 ladder on the standard buckets (see KeyRateBuckets) rather
+    // than the curve's own nodes. Each cashflow's sensitivity goes straight to
+    // the buckets through the cached allocation of its two nodes, in the same
+    // sweep as get_DV01_ladder, so there is no node ladder to remap.
+    std::optional<std::map<int, double>> get_bucketed_DV01_ladder(
+        CcyGroup::Currency ccy,
+        SensitivityMethod method = SensitivityMethod::CentralDifference) {
+        if (!check_rates(ccy) || !check_fx(ccy)) return {};
+        Log::info_bucketed_DV01_ladder(CcyGroup::to_string(ccy),
+                                       key_rate_buckets.tenors.size());
+
+        CashflowGrid grid{get_grid(ccy)};
+        const auto& buckets = key_rate_buckets.tenors;
+        auto ladder = get_ladder(grid, method, get_key_rate_allocation(ccy),
+                                 buckets.size());
+
+        // Convert sensitivities to local rates to the reporting ccy
+        double fx{get_reporting_conversion(ccy)};
+        std::map<int, double> result;
+        for (size_t b = 0; b < buckets.size(); ++b) {
+            result.emplace(buckets[b], fx * ladder[b]);
+        }
+        return std::make_optional(std::move(result));
+    }
+
+    // Get the DV01 to the par rate of the hedging instrument at every tenor
+    // (see ParJacobian), from the zero-rate ladder and the inverse Jacobian
+    // of the curve, which is cached until the curve changes
+    std::optional<std::map<int, double>> get_par_DV01_ladder(
+        CcyGroup::Currency ccy,
+        SensitivityMethod method = SensitivityMethod::CentralDifference) {
+        auto zero_ladder = get_DV01_ladder(ccy, method);
+        if (!zero_ladder) return {};
+        Log::info_par_DV01_ladder(CcyGroup::to_string(ccy));
+
+        auto v = std::views::values(*zero_ladder);
+        auto par_ladder = get_par_jacobian(ccy).to_par({v.begin(), v.end()});
+        std::map<int, double> result;
+        size_t i{0};
+        for (int tenor : std::views::keys(*zero_ladder)) {
+            result.emplace(tenor, par_ladder[i++]);
+        }
+        return std::make_optional(std::move(result));
+    }
+
+    // Get DV01 ladders for several currencies by bumping and revaluing, with
+    // the (currency, tenor, +/-bump) jobs spread over the pool. Each job
+    // values the book against a private copy of the curve, so the shared
+    // curves are never mutated and every result is identical to the serial
+    // get_DV01(ccy, tenor). Currencies without rates or spot are left out.
+    std::map<typename CcyGroup::Currency, std::map<int, double>>
+    get_DV01_ladders(const std::vector<typename CcyGroup::Currency>& ccys) {
+        Log::info_DV01_ladders(ccys.size(), pool->size());
+        struct Job {
+            typename CcyGroup::Currency ccy;
+            int tenor;
+            std::future<double> up, down;
+        };
+        std::vector<Job> jobs;
+        std::map<typename CcyGroup::Currency, double> fx;
+        for (auto ccy : ccys) {
+            if (!check_rates(ccy) || !check_fx(ccy)) continue;
+            fx[ccy] = get_reporting_conversion(ccy);
+            const auto& rates = currency_rates.at(ccy);
+            if (!check_maturities(ccy)) {
+                for (int tenor : rates.get_tenors()) {
+                    jobs.push_back({ccy, tenor, {}, {}});
+                }
+                continue;
+            }
+            const auto& trades = currency_notionals.at(ccy);
+            auto get_bumped_value = [&rates, &trades](int tenor, double bump) {
+                InterestRates curve{rates};
+                curve.add_rate(tenor, rates.get_rate(tenor) + bump);
+                auto discount_fn = [&curve](int t) {
+                    return curve.get_discount_factor(t);
+                };
+                return trades.get_book_value(discount_fn, false);
             };
-            return trades.get_book_value(discount_fn);
+            for (int tenor : rates.get_tenors()) {
+                jobs.push_back(
+                    {ccy, tenor,
+                     pool->submit([=] { return get_bumped_value(tenor, EPS); }),
+                     pool->submit(
+                         [=] { return get_bumped_value(tenor, -EPS); })});
+            }
+        }
+
+        std::map<typename CcyGroup::Currency, std::map<int, double>> ladders;
+        for (auto& job : jobs) {
+            double dv01{0.0};
+            if (job.up.valid()) {
+                // same expression as get_DV01 so results agree to the bit
+                double up{pool->join(job.up)}, down{pool->join(job.down)};
+                dv01 = fx.at(job.ccy) * -(up - down) / 2;
+            }
+            ladders[job.ccy].emplace(job.tenor, dv01);
+        }
+        return ladders;
+    }
+
+    // One request of a batch: the discount factor to tenor, the DV01 to the
+    // tenor node, the DV01 to a parallel shift or the book PV (tenor unused)
+    enum class QueryKind { DiscountFactor, DV01, ParallelDV01, PV };
+    struct RiskQuery {
+        QueryKind kind;
+        typename CcyGroup::Currency ccy;
+        int tenor{0};
+        auto operator<=>(const RiskQuery&) const = default;
+    };
+
+    // Answer a batch of queries, in input order, with an empty result for
+    // invalid ones (no curve or spot, a DV01 tenor that is not a node, a
+    // negative tenor). Duplicates are answered once. Queries are grouped by
+    // currency and each group is one job on the pool, checked and
+    // logged once, with one cashflow grid: all tenor DV01s come from a single
+    // ladder sweep (as get_DV01_ladder), and the PV and parallel DV01 from
+    // sweeps of the same grid. Results are in the reporting currency.
+    std::vector<std::optional<double>> run_queries(
+        const std::vector<RiskQuery>& queries) {
+        std::vector<RiskQuery> unique{queries};
+        std::ranges::sort(unique);  // also groups them by currency
+        auto [first, last] = std::ranges::unique(unique);
+        unique.erase(first, last);
+        std::vector<std::optional<double>> answers(unique.size());
+
+        struct Group {
+            typename CcyGroup::Currency ccy;
+            size_t begin, end;  // of unique
+            bool has_fx;
+            double fx;
         };
+        std::vector<Group> groups;
+        for (size_t begin = 0; begin < unique.size();) {
+            auto ccy = unique[begin].ccy;
+            size_t end{begin};
+            while (end < unique.size() && unique[end].ccy == ccy) ++end;
+            if (check_rates(ccy)) {
+                bool has_fx{currency_spot.contains(ccy)};
+                groups.push_back(
+                    {ccy, begin, end, has_fx,
+                     has_fx ? get_reporting_conversion(ccy) : 0.0});
+            }
+            begin = end;
+        }
+        Log::info_queries(queries.size(), unique.size(), groups.size());
 
-        // Convert sensitivity to local rates to USD before returning
-        return std::make_optional(
-            get_fx_spot({CcyGroup::Currency::USD, ccy}).value() *
-            // 2nd-order approx
-            -(get_bumped_value(EPS) - get_bumped_value(-EPS)) / 2);
+        pool->parallel_for(
+            groups.size(), [this, &groups, &unique, &answers](size_t g) {
+                const auto& group = groups[g];
+                answer_queries(group.ccy, group.has_fx, group.fx,
+                               {unique.begin() + group.begin,
+                                unique.begin() + group.end},
+                               {answers.begin() + group.begin,
+                                answers.begin() + group.end});
+            });
+
+        std::vector<std::optional<double>> results;
+        results.reserve(queries.size());
+        for (auto& query : queries) {
+            results.push_back(answers[std::ranges::lower_bound(unique, query) -
+                                      unique.begin()]);
+        }
+        return results;
     }
 
-    // Get the DV01 in the desired ccy by bumping the entire curve
-    std::optional<double> get_DV01(CcyGroup::Currency ccy) {
+    // PV changes (reporting ccy) for parallel shifts of the whole curve
+    static constexpr std::array<double, 10> CONVEXITY_SHIFTS{
+        -200e-4, -100e-4, -50e-4, -10e-4, -1e-4,
+        1e-4,    10e-4,   50e-4,  100e-4, 200e-4};
+    struct ConvexityProfile {
+        std::array<double, CONVEXITY_SHIFTS.size()> shifts{CONVEXITY_SHIFTS},
+            pnl{};
+    };
+
+    // Get the convexity profile of the book in each currency with rates,
+    // spot and trades: the PV change for every shift in CONVEXITY_SHIFTS, all
+    // valued in a single pass over the cashflows (see
+    // CashflowGrid::get_shifted_book_values) rather than one bump_curve and
+    // revaluation per shift, one job per currency on the pool
+    std::map<typename CcyGroup::Currency, ConvexityProfile>
+    get_convexity_profile() {
+        Log::info_convexity(CONVEXITY_SHIFTS.size());
+        auto [ccys, grids] = get_priced_grids();
+        auto pnls = pool->parallel_map(grids.size(), [&grids](size_t i) {
+            const auto& grid = grids[i];
+            double base{grid.get_book_value(grid.rates)};
+            auto values = grid.get_shifted_book_values(CONVEXITY_SHIFTS);
+            for (double& value : values) value -= base;
+            return values;
+        });
+        std::map<typename CcyGroup::Currency, ConvexityProfile> profiles;
+        for (size_t i = 0; i < ccys.size(); ++i) {
+            double fx{get_reporting_conversion(ccys[i])};
+            ConvexityProfile profile;
+            for (size_t k = 0; k < pnls[i].size(); ++k) {
+                profile.pnl[k] = fx * pnls[i][k];
+            }
+            profiles.emplace(ccys[i], profile);
+        }
+        return profiles;
+    }
+
+    // Expected PV (reporting ccy) at each future horizon, in days from today
+    struct ExposureProfile {
+        std::vector<int> horizons;
+        std::vector<double> exposure;
+    };
+
+    // Get the exposure profile of the book in each currency with rates, spot
+    // and trades at horizons 0, step, 2 * step, ... up to end (monthly to 30Y
+    // by default), in one sweep over its sorted cashflows per currency (see
+    // CashflowGrid::get_forward_book_values), one job per currency on the pool
+    std::map<typename CcyGroup::Currency, ExposureProfile> get_exposure_profile(
+        int step = 30, int end = 30 * 360) {
+        if (step <= 0 || !check_tenor_val(end)) return {};
+        Log::info_exposure(step, end);
+        std::vector<int> horizons;
+        for (int h = 0; h <= end; h += step) horizons.push_back(h);
+
+        auto [ccys, grids] = get_priced_grids();
+        auto values =
+            pool->parallel_map(grids.size(), [&grids, &horizons](size_t i) {
+                return grids[i].get_forward_book_values(horizons);
+            });
+        std::map<typename CcyGroup::Currency, ExposureProfile> profiles;
+        for (size_t i = 0; i < ccys.size(); ++i) {
+            double fx{get_reporting_conversion(ccys[i])};
+            for (double& value : values[i]) value *= fx;
+            profiles.emplace(ccys[i],
+                             ExposureProfile{horizons, std::move(values[i])});
+        }
+        return profiles;
+    }
+
+    // Widths in days of the daily, weekly and monthly cash ladders
+    static constexpr std::array<int, 3> CASH_BUCKETS{1, 7, 30};
+
+    // Get the daily, weekly and monthly cash ladders, undiscounted and
+    // discounted, of the book in each currency with rates and trades. Cash
+    // stays in its own currency: liquidity in one is not liquidity in another.
+    // Currencies are bucketed in parallel on the pool.
+    std::map<typename CcyGroup::Currency,
+             std::array<CashLadder, CASH_BUCKETS.size()>>
+    get_cash_ladders() {
+        Log::info_cash_ladders(CASH_BUCKETS.size());
+        std::vector<typename CcyGroup::Currency> ccys;
+        std::vector<CashflowGrid> grids;
+        for (auto& [ccy, trades] : currency_notionals) {
+            if (!currency_rates.contains(ccy)) continue;
+            ccys.push_back(ccy);
+            grids.push_back(get_grid(ccy));
+        }
+        auto ccy_ladders = pool->parallel_map(grids.size(), [&grids](size_t i) {
+            return grids[i].get_cash_ladders(CASH_BUCKETS);
+        });
+        std::map<typename CcyGroup::Currency,
+                 std::array<CashLadder, CASH_BUCKETS.size()>>
+            ladders;
+        for (size_t i = 0; i < ccys.size(); ++i) {
+            ladders.emplace(ccys[i], std::move(ccy_ladders[i]));
+        }
+        return ladders;
+    }
+
+    // Rows and columns of the gamma matrix are the tenors of the curve
+    struct GammaMatrix {
+        std::vector<int> tenors;
+        SymmetricMatrix gamma;
+    };
+
+    // Get the cross-gamma of the book to every pair of tenors, as the PV
+    // change (reporting ccy) for bumps of EPS to both (d2PV / dr_i dr_k *
+    // EPS^2). This is the analytic limit of the four-point central difference
+    // stencil and needs one pass over the cashflows, split into chunks summed
+    // on the pool.
+    std::optional<GammaMatrix> get_gamma_matrix(CcyGroup::Currency ccy) {
         if (!check_rates(ccy) || !check_fx(ccy)) return {};
-        Log::info_DV01(CcyGroup::to_string(ccy));
+        Log::info_gamma(CcyGroup::to_string(ccy));
 
-        auto& rates = currency_rates.at(ccy);
-        auto& trades = currency_notionals.at(ccy);
+        CashflowGrid grid{get_grid(ccy)};
+        SymmetricMatrix gamma{grid.tenors.size()};
+        // fixed chunks, summed in order, so the sum is the same on any pool
+        size_t n_chunks{(grid.size() + GAMMA_CHUNK - 1) / GAMMA_CHUNK};
+        auto partials = pool->parallel_map(n_chunks, [&grid](size_t c) {
+            return grid.get_gamma(c * GAMMA_CHUNK,
+                                  std::min((c + 1) * GAMMA_CHUNK, grid.size()));
+        });
+        for (auto& partial : partials) gamma += partial;
 
-        // Bump the curve in its own scope so it gets unbumped when we exit
-        auto get_bumped_value = [&rates, &trades](double bump) {
-            auto unbump_later = rates.bump_curve(bump);
-            auto discount_fn = [&rates](int tenor) {
-                return rates.get_discount_factor(tenor);
-            };
-            return trades.get_book_value(discount_fn);
+        // Convert sensitivities to local rates to the reporting ccy
+        gamma *= get_reporting_conversion(ccy) * EPS * EPS;
+        return std::make_optional(GammaMatrix{grid.tenors, std::move(gamma)});
+    }
+
+    // Get the book PV of positions in ccy, in ccy
+    std::optional<double> get_book_value(CcyGroup::Currency ccy) {
+        if (!check_rates(ccy)) return {};
+        return std::make_optional(get_grid(ccy).get_book_value(
+            currency_rates.at(ccy).get_rates()));
+    }
+
+    // Get the FX delta of the whole portfolio to every spot in currency_spot
+    // (but the USD numeraire), as the change in its USD value for a relative
+    // move of FX_EPS in the CCYUSD spot. Positions are linear in spot, so the
+    // delta is exactly the USD value of the book times FX_EPS: each book PV
+    // is found once in its own currency and no spot is bumped.
+    std::map<typename CcyGroup::Currency, double> get_FX_delta() {
+        Log::info_FX_delta();
+        std::map<typename CcyGroup::Currency, double> deltas;
+        for (auto& [ccy, _] : currency_spot) {
+            if (ccy == CcyGroup::Currency::USD) continue;
+            double pv{check_maturities(ccy) ? get_book_value(ccy).value_or(0.0)
+                                            : 0.0};
+            deltas.emplace(ccy, pv * get_usd_conversion(ccy) * FX_EPS);
+        }
+        return deltas;
+    }
+
+    // PV changes in the reporting ccy over a roll of the valuation date.
+    // Theta keeps the curve fixed as a function of tenor, so each cashflow is
+    // discounted for days less; carry assumes the forwards are realised
+    // instead, so the book grows at the rate to days. Their difference is the
+    // roll-down.
+    struct ThetaCarry {
+        double theta{0.0}, carry{0.0};
+    };
+
+    // Get theta and carry of the book in each currency with rates and spot,
+    // one job per currency on the pool. The cashflow grids built for
+    // today are reused: a rolled cashflow mostly stays between the same two
+    // nodes, and the trades are not re-read with a new delta. The date only
+    // rolls forward: RETURNS nothing for negative days.
+    std::map<typename CcyGroup::Currency, ThetaCarry> get_theta(int days = 1) {
+        if (!check_tenor_val(days)) return {};
+        Log::info_theta(days, currency_notionals.size());
+        struct Job {
+            typename CcyGroup::Currency ccy;
+            double fx, carry_factor;  // 1 / DF(days) - 1
+            CashflowGrid grid;
         };
+        std::vector<Job> jobs;
+        for (auto& [ccy, trades] : currency_notionals) {
+            if (!currency_rates.contains(ccy) || !currency_spot.contains(ccy)) {
+                continue;
+            }
+            double df{currency_rates.at(ccy).get_discount_factor(days)};
+            jobs.push_back({ccy, get_reporting_conversion(ccy), 1 / df - 1,
+                            get_grid(ccy)});
+        }
 
-        // Convert sensitivity to local rates to USD before returning
-        return std::make_optional(
-            get_fx_spot({CcyGroup::Currency::USD, ccy}).value() *
-            // 2nd-order approx
-            -(get_bumped_value(EPS) - get_bumped_value(-EPS)) / 2);
+        auto results = pool->parallel_map(jobs.size(), [&jobs, days](size_t i) {
+            const auto& job = jobs[i];
+            double pv{job.grid.get_book_value(job.grid.rates)};
+            double rolled{job.grid.get_rolled_book_value(days)};
+            return ThetaCarry{job.fx * (rolled - pv),
+                              job.fx * pv * job.carry_factor};
+        });
+        std::map<typename CcyGroup::Currency, ThetaCarry> theta;
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            theta.emplace(jobs[i].ccy, results[i]);
+        }
+        return theta;
+    }
+
+    // A P&L in USD split into what the risk at the start predicts and the
+    // rest: rates holds -DV01 * (rate move) / EPS for each tenor of the start
+    // curve, gamma the second-order rate term, fx the spot delta times the
+    // relative spot move and time the theta. unexplained is what a full
+    // revaluation at the end adds on top (cross and higher-order terms).
+    struct PnLExplain {
+        std::vector<int> tenors;
+        std::vector<double> rates;
+        double gamma{0.0}, fx{0.0}, time{0.0}, unexplained{0.0};
+        double get_explained() const {
+            return std::reduce(rates.begin(), rates.end()) + gamma + fx + time;
+        }
+        double get_actual() const { return get_explained() + unexplained; }
+    };
+
+    // Explain the P&L of the book in each currency between two rates.txt-style
+    // snapshots, with the valuation date rolled by days in between. Ladders,
+    // gamma and theta all come from one sweep over each currency's cashflows
+    // against the start curve, and the full revaluation at the end curve is
+    // only used for the unexplained part. Currencies run as one batch on the
+    // pool; those missing from either snapshot are left out.
+    std::map<typename CcyGroup::Currency, PnLExplain> explain_PnL(
+        const std::string& from_path, const std::string& to_path,
+        int days = 1) {
+        if (!check_tenor_val(days)) return {};  // the date only rolls forward
+        Log::info_PnL_explain(from_path, to_path);
+        std::ifstream in_from{from_path}, in_to{to_path};
+        if (!check_data(in_from, from_path) || !check_data(in_to, to_path)) {
+            return {};
+        }
+        std::unordered_map<typename CcyGroup::Currency, InterestRates>
+            from_rates, to_rates;
+        std::unordered_map<typename CcyGroup::Currency, FXSpot> from_spots{
+            {CcyGroup::Currency::USD, {}}},
+            to_spots{{CcyGroup::Currency::USD, {}}};
+        load_market(in_from, from_rates, from_spots);
+        load_market(in_to, to_rates, to_spots);
+
+        struct Job {
+            typename CcyGroup::Currency ccy;
+            double from_fx, to_fx;
+            CashflowGrid from, to;
+            std::vector<double> rate_moves;  // at the tenors of from
+        };
+        std::vector<Job> jobs;
+        for (auto& [ccy, trades] : currency_notionals) {
+            if (!from_rates.contains(ccy) || !to_rates.contains(ccy) ||
+                !from_spots.contains(ccy) || !to_spots.contains(ccy)) {
+                continue;
+            }
+            auto to_usd = [ccy](auto& spots) {
+                return spots.at(ccy) / spots.at(CcyGroup::Currency::USD);
+            };
+            Job job{ccy,
+                    to_usd(from_spots),
+                    to_usd(to_spots),
+                    {from_rates.at(ccy), trades},
+                    {to_rates.at(ccy), trades},
+                    {}};
+            // the end curve may have other nodes: compare interpolated rates
+            const auto& to_curve = to_rates.at(ccy);
+            for (size_t i = 0; i < job.from.tenors.size(); ++i) {
+                int tenor{job.from.tenors[i]};
+                double to_rate{0.0};
+                if (tenor > 0) {
+                    to_rate = -std::log(to_curve.get_discount_factor(tenor)) *
+                              360 / tenor;
+                } else if (to_curve.check_tenor(0)) {
+                    // a DF of 1 implies no rate at 0D: take the node rate, or
+                    // else the origin (0, 0.0) of the interpolation
+                    to_rate = to_curve.get_rate(0);
+                }
+                job.rate_moves.push_back(to_rate - job.from.rates[i]);
+            }
+            jobs.push_back(std::move(job));
+        }
+
+        auto results = pool->parallel_map(jobs.size(), [&jobs, days](size_t i) {
+            const auto& job = jobs[i];
+            const auto& grid = job.from;
+            PnLExplain explain{grid.tenors,
+                               std::vector<double>(grid.tenors.size())};
+            double pv{0.0}, gamma{0.0};
+            for (size_t j = 0; j < grid.size(); ++j) {
+                const auto& nw = grid.weights[j];
+                double t{grid.times[j] / 360.0};
+                double npv{grid.notionals[j] *
+                           grid.get_discount_factor(j, grid.rates)};
+                double move{grid.get_rate(j, job.rate_moves)};
+                pv += npv;
+                // dPV/dr_i = -w_i * t * n * DF
+                if (nw.left >= 0) {
+                    explain.rates[nw.left] -=
+                        npv * t * nw.w_left * job.rate_moves[nw.left];
+                }
+                if (nw.right >= 0) {
+                    explain.rates[nw.right] -=
+                        npv * t * nw.w_right * job.rate_moves[nw.right];
+                }
+                gamma += npv * t * t * move * move / 2;
+            }
+            for (double& rate : explain.rates) rate *= job.from_fx;
+            explain.gamma = job.from_fx * gamma;
+            explain.fx = (job.to_fx - job.from_fx) * pv;
+            explain.time =
+                job.from_fx * (grid.get_rolled_book_value(days) - pv);
+            double actual{job.to_fx * job.to.get_rolled_book_value(days) -
+                          job.from_fx * pv};
+            explain.unexplained = actual - explain.get_explained();
+            return explain;
+        });
+        std::map<typename CcyGroup::Currency, PnLExplain> explains;
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            explains.emplace(jobs[i].ccy, std::move(results[i]));
+        }
+        return explains;
+    }
+
+    ////////////////////////////// SCENARIO RISK //////////////////////////////
+
+    // A risk factor is a curve node (ccy, tenor) or, with tenor SPOT, the
+    // CCYUSD spot of ccy
+    struct RiskFactor {
+        typename CcyGroup::Currency ccy;
+        int tenor;
+        auto operator<=>(const RiskFactor&) const = default;
+    };
+    static constexpr int SPOT{-1};
+
+    // Daily values of the risk factors of today's market, oldest first, as a
+    // dense row-major days x factors matrix
+    struct MarketHistory {
+        std::vector<RiskFactor> factors;
+        std::vector<double> values;
+        size_t get_days() const {
+            return factors.empty() ? 0 : values.size() / factors.size();
+        }
+        double at(size_t day, size_t factor) const {
+            return values[day * factors.size() + factor];
+        }
+    };
+
+    // Factor moves applied to today's market as a dense row-major scenarios x
+    // factors matrix: absolute for rates, relative for spots
+    struct Scenarios {
+        std::vector<RiskFactor> factors;
+        std::vector<double> shifts;
+        size_t size() const {
+            return factors.empty() ? 0 : shifts.size() / factors.size();
+        }
+    };
+
+    // Loss statistics in USD (losses are positive) with the part of each
+    // that comes from the positions in each currency (these add up)
+    struct VaRResult {
+        double VaR{0.0}, ES{0.0};
+        std::map<typename CcyGroup::Currency, double> VaR_contributions,
+            ES_contributions;
+    };
+
+    // Curve nodes of every currency (in tenor order) then non-USD spots
+    std::vector<RiskFactor> get_risk_factors() {
+        std::vector<RiskFactor> factors;
+        for (auto& [ccy, rates] : currency_rates) {
+            for (int tenor : rates.get_tenors()) {
+                factors.push_back({ccy, tenor});
+            }
+        }
+        for (auto& [ccy, fx] : currency_spot) {
+            if (ccy != CcyGroup::Currency::USD) factors.push_back({ccy, SPOT});
+        }
+        std::ranges::sort(factors);
+        return factors;
+    }
+
+    // Loads rates.txt-style snapshots (one file per day, oldest first) into a
+    // time series of today's risk factors. A factor missing from a snapshot
+    // keeps its value from the day before (or today's value on the first day)
+    MarketHistory load_history(const std::vector<std::string>& paths) {
+        MarketHistory history{get_risk_factors(), {}};
+        const auto& factors = history.factors;
+        history.values.reserve(paths.size() * factors.size());
+        for (size_t day = 0; day < paths.size(); ++day) {
+            std::ifstream in{paths[day]};
+            if (!check_data(in, paths[day])) continue;
+            std::unordered_map<typename CcyGroup::Currency, InterestRates>
+                rates;
+            std::unordered_map<typename CcyGroup::Currency, FXSpot> spots;
+            load_market(in, rates, spots);
+            size_t row{history.values.size()};
+            for (size_t f = 0; f < factors.size(); ++f) {
+                auto& [ccy, tenor] = factors[f];
+                double value{row == 0
+                                 ? get_factor_value(factors[f])
+                                 : history.values[row - factors.size() + f]};
+                if (tenor == SPOT && spots.contains(ccy)) {
+                    value = spots.at(ccy).get_spot();
+                } else if (tenor != SPOT && rates.contains(ccy) &&
+                           rates.at(ccy).check_tenor(tenor)) {
+                    value = rates.at(ccy).get_rate(tenor);
+                }
+                history.values.push_back(value);
+            }
+        }
+        Log::info_history(history.get_days(), factors.size());
+        return history;
+    }
+
+    // Turns the last window day-on-day moves of a history into scenarios
+    Scenarios get_historical_scenarios(const MarketHistory& history,
+                                       size_t window = 500) {
+        Scenarios scenarios{history.factors, {}};
+        size_t days{history.get_days()};
+        size_t first{days > window + 1 ? days - window - 1 : 0};
+        for (size_t day = first + 1; day < days; ++day) {
+            for (size_t f = 0; f < history.factors.size(); ++f) {
+                double before{history.at(day - 1, f)};
+                double after{history.at(day, f)};
+                scenarios.shifts.push_back(history.factors[f].tenor == SPOT
+                                               ? after / before - 1
+                                               : after - before);
+            }
+        }
+        return scenarios;
+    }
+
+    // Get 1-day VaR and expected shortfall by historical simulation: apply the
+    // day-on-day moves of the last window days of history to today's market
+    // and revalue all books under all scenarios at once
+    VaRResult get_historical_VaR(const MarketHistory& history,
+                                 double confidence = 0.99,
+                                 size_t window = 500) {
+        Log::info_historical_VaR(confidence, window);
+        return get_tail_risk(
+            get_scenario_pnl(get_historical_scenarios(history, window)),
+            confidence);
+    }
+
+    // P&L in USD of the book in each currency (columns) under each stress
+    // scenario (rows), row-major
+    struct StressTable {
+        std::vector<std::string> scenarios;
+        std::vector<typename CcyGroup::Currency> currencies;
+        std::vector<double> pnl;
+        double at(size_t scenario, size_t ccy) const {
+            return pnl[scenario * currencies.size() + ccy];
+        }
+    };
+
+    // Reads stress definitions, one per line after a # header:
+    //   <name> PARALLEL <bp>
+    //   <name> TWIST <short end bp> <long end bp>
+    //   <name> FX <relative move of every XXXUSD spot>
+    std::vector<StressScenario> load_stresses(const std::string& path) {
+        std::ifstream in{path};
+        std::vector<StressScenario> stresses;
+        if (!check_data(in, path)) return stresses;
+        std::string line;
+        std::getline(in, line);  // discard the first line starting with #
+        while (std::getline(in, line)) {
+            auto stress = StressScenario::parse(line);
+            if (!stress) {
+                Log::warn_line(line);
+                continue;
+            }
+            stresses.push_back(std::move(*stress));
+        }
+        return stresses;
+    }
+
+    // Run every stress on every currency at once. The base PV of each cashflow
+    // is found once per book and shared by all scenarios, and the books are
+    // valued in parallel, one job per currency.
+    StressTable run_stresses(const std::vector<StressScenario>& stresses) {
+        Log::info_stresses(stresses.size());
+        Scenarios scenarios{get_risk_factors(), {}};
+        for (auto& stress : stresses) {
+            for (auto& [ccy, tenor] : scenarios.factors) {
+                scenarios.shifts.push_back(tenor == SPOT
+                                               ? stress.get_fx_shift()
+                                               : stress.get_rate_shift(tenor));
+            }
+        }
+        const auto books = get_scenario_books(scenarios.factors);
+
+        StressTable table;
+        for (auto& stress : stresses) table.scenarios.push_back(stress.name);
+        for (auto& book : books) table.currencies.push_back(book.ccy);
+        std::vector<std::vector<double>> pnl;
+        value_scenarios(*pool, books, scenarios.shifts.data(), scenarios.size(),
+                        scenarios.factors.size(), pnl);
+        for (size_t s = 0; s < stresses.size(); ++s) {
+            for (size_t b = 0; b < books.size(); ++b) {
+                table.pnl.push_back(pnl[b][s]);
+            }
+        }
+        return table;
+    }
+
+    // Covariance of daily factor moves (absolute for rates, relative for spots)
+    struct Covariance {
+        std::vector<RiskFactor> factors;
+        SymmetricMatrix matrix;
+    };
+
+    // Sample covariance of the factor moves in a set of scenarios
+    Covariance get_covariance(const Scenarios& scenarios) {
+        size_t n{scenarios.size()}, n_factors{scenarios.factors.size()};
+        Covariance covariance{scenarios.factors, SymmetricMatrix{n_factors}};
+        if (n < 2) return covariance;
+        std::vector<double> mean(n_factors, 0.0);
+        for (size_t s = 0; s < n; ++s) {
+            for (size_t f = 0; f < n_factors; ++f) {
+                mean[f] += scenarios.shifts[s * n_factors + f] / n;
+            }
+        }
+        for (size_t s = 0; s < n; ++s) {
+            const double* x{scenarios.shifts.data() + s * n_factors};
+            for (size_t f = 0; f < n_factors; ++f) {
+                for (size_t g = 0; g <= f; ++g) {
+                    covariance.matrix(f, g) +=
+                        (x[f] - mean[f]) * (x[g] - mean[g]) / (n - 1);
+                }
+            }
+        }
+        return covariance;
+    }
+
+    // Reads the covariance of today's risk factors from lines of
+    // <factor> <factor> <covariance>, with factors named as in rates.txt.
+    // Pairs that are not listed are uncorrelated.
+    Covariance load_covariance(const std::string& path) {
+        auto factors = get_risk_factors();
+        Covariance covariance{factors, SymmetricMatrix{factors.size()}};
+        std::ifstream in{path};
+        if (!check_data(in, path)) return covariance;
+        std::map<RiskFactor, size_t> index;
+        for (size_t f = 0; f < factors.size(); ++f) {
+            index.emplace(factors[f], f);
+        }
+
+        std::string line;
+        std::getline(in, line);  // discard the first line starting with #
+        while (std::getline(in, line)) {
+            std::istringstream s_line{line};
+            std::string first, second;
+            double value;
+            if (!(s_line >> first >> second >> value)) {
+                Log::warn_line(line);
+                continue;
+            }
+            auto f = parse_factor(first), g = parse_factor(second);
+            if (!f || !g || !index.contains(*f) || !index.contains(*g)) {
+                Log::warn_line(line);
+                continue;
+            }
+            covariance.matrix(index.at(*f), index.at(*g)) = value;
+        }
+        return covariance;
+    }
+
+    // Prepare delta-normal VaR: sensitivities of the portfolio to every
+    // factor of the covariance (DV01 ladders and FX deltas, per unit move) are
+    // combined as VaR = z * sqrt(s' C s). Factors of one currency must be
+    // contiguous, as they are in get_risk_factors().
+    void set_parametric_covariance(const Covariance& covariance) {
+        parametric_factors = covariance.factors;
+        parametric.emplace(covariance.matrix);
+        parametric_blocks.clear();
+        for (size_t f = 0; f < parametric_factors.size(); ++f) {
+            auto ccy = parametric_factors[f].ccy;
+            auto [it, inserted] = parametric_blocks.try_emplace(ccy, f, f);
+            it->second.second = f + 1;
+        }
+        for (auto& [ccy, block] : parametric_blocks) update_parametric_VaR(ccy);
+    }
+
+    // Recompute the sensitivities of one currency after its curve, spot or
+    // trades change (add_rate, set_spot and add_trade call it). They are read
+    // off the live book (see get_live_risk), so a rate tick costs what it
+    // costs the live risk, and only its block of C s is updated, in
+    // O(factors x block)
+    void update_parametric_VaR(CcyGroup::Currency ccy) {
+        if (!parametric || !parametric_blocks.contains(ccy)) return;
+        auto [begin, end] = parametric_blocks.at(ccy);
+        std::vector<double> block(end - begin, 0.0);
+        if (currency_rates.contains(ccy) && currency_spot.contains(ccy)) {
+            const auto& book = get_live_book(ccy);
+            const auto& tenors = book.get_grid().tenors;
+            auto ladder = book.get_ladder();
+            // in USD, not the reporting currency of get_live_risk
+            double fx{get_usd_conversion(ccy)};
+            for (size_t f = begin; f < end; ++f) {
+                int tenor{parametric_factors[f].tenor};
+                if (tenor == SPOT) {
+                    // dPV / d(relative spot move) is the USD value of the book
+                    block[f - begin] = fx * book.get_book_value();
+                    continue;
+                }
+                auto it = std::ranges::lower_bound(tenors, tenor);
+                if (it != tenors.end() && *it == tenor) {
+                    // dPV / dr
+                    block[f - begin] = -fx * ladder[it - tenors.begin()] / EPS;
+                }
+            }
+        }
+        parametric->set_sensitivities(begin, block);
+    }
+
+    // Get 1-day delta-normal VaR and expected shortfall (for normal P&L,
+    // ES = sigma * pdf(z) / (1 - confidence)) with Euler contributions
+    // s_ccy' (C s) / sigma from the prepared sensitivities
+    VaRResult get_parametric_VaR(double confidence = 0.99) {
+        VaRResult result;
+        if (!parametric) return result;
+        Log::info_parametric_VaR(confidence);
+        double sigma{std::sqrt(parametric->get_variance())};
+        if (sigma == 0.0) return result;
+        double z{inverse_normal_cdf(confidence)};
+        double es_factor{std::exp(-z * z / 2) /
+                         std::sqrt(2 * std::numbers::pi) / (1 - confidence)};
+        result.VaR = z * sigma;
+        result.ES = es_factor * sigma;
+        for (auto& [ccy, block] : parametric_blocks) {
+            auto [begin, end] = block;
+            double share{parametric->get_contribution(begin, end) / sigma};
+            result.VaR_contributions[ccy] = z * share;
+            result.ES_contributions[ccy] = es_factor * share;
+        }
+        return result;
+    }
+
+    // Get 1-day VaR and expected shortfall by Monte Carlo: simulate correlated
+    // normal moves of every factor (L z with C = L L^T) and revalue the books.
+    // Only the worst (1 - confidence) * n_paths P&Ls are kept (an ExactTail),
+    // so memory is bounded by the tail rather than the number of paths.
+    VaRResult get_MC_VaR(const Covariance& covariance, size_t n_paths,
+                         double confidence = 0.99, uint64_t seed = 5226) {
+        Log::info_MC_VaR(confidence, n_paths);
+        const auto books = get_scenario_books(covariance.factors);
+        size_t k{static_cast<size_t>(
+            std::ceil((1 - confidence) * n_paths - 1e-9))};
+        k = std::clamp<size_t>(k, 1, std::max<size_t>(n_paths, 1));
+
+        auto tail = simulate_MC(
+            *pool, books, covariance, n_paths, seed,
+            [k] { return ExactTail{k}; },
+            [](ExactTail& tail, const std::vector<double>& pnl) {
+                tail.push(-std::reduce(pnl.begin(), pnl.end()), pnl);
+            });
+
+        VaRResult result;
+        auto worst = tail.get_sorted();
+        if (worst.empty()) return result;
+        result.VaR = worst.back().loss;
+        for (auto& scenario : worst) result.ES += scenario.loss / worst.size();
+        for (size_t b = 0; b < books.size(); ++b) {
+            result.VaR_contributions[books[b].ccy] = -worst.back().payload[b];
+            double es{0.0};
+            for (auto& scenario : worst) {
+                es -= scenario.payload[b] / worst.size();
+            }
+            result.ES_contributions[books[b].ccy] = es;
+        }
+        return result;
+    }
+
+    // Get the Monte Carlo loss distribution of the portfolio as a t-digest, to
+    // read VaR and ES at any number of confidence levels in constant memory
+    TailStats get_MC_tail_stats(const Covariance& covariance, size_t n_paths,
+                                uint64_t seed = 5226) {
+        Log::info_MC_tail_stats(n_paths);
+        const auto books = get_scenario_books(covariance.factors);
+        return simulate_MC(
+            *pool, books, covariance, n_paths, seed, [] { return TailStats{}; },
+            [](TailStats& tail, const std::vector<double>& pnl) {
+                tail.add(-std::reduce(pnl.begin(), pnl.end()));
+            });
+    }
+
+    // PV of all positions in USD, with its derivatives w.r.t. every curve
+    // node and FX spot (including the USD numeraire)
+    struct PVGradient {
+        double value{0.0};
+        std::map<typename CcyGroup::Currency, std::map<int, double>> rates;
+        std::map<typename CcyGroup::Currency, double> spots;
+    };
+
+    // Get the full gradient of the PV with adjoint algorithmic differentiation:
+    // record one valuation on the tape and sweep it backwards once, instead of
+    // bumping each of the inputs in turn
+    PVGradient get_PV_gradient() {
+        Log::info_PV_gradient();
+        tape.activate();
+        tape.rewind();
+
+        std::unordered_map<typename CcyGroup::Currency, Number> spots;
+        for (auto& [ccy, fx] : currency_spot) {
+            spots.emplace(ccy, tape.new_variable(fx.get_spot()));
+        }
+        std::unordered_map<typename CcyGroup::Currency, std::vector<Number>>
+            node_rates;
+        for (auto& [ccy, rates] : currency_rates) {
+            auto& r = node_rates[ccy];
+            for (double rate : rates.get_rates()) {
+                r.push_back(tape.new_variable(rate));
+            }
+        }
+
+        Number pv{0.0};
+        for (auto& [ccy, book] : currency_notionals) {
+            if (!check_rates(ccy) || !check_fx(ccy)) continue;
+            CashflowGrid grid{currency_rates.at(ccy), book};
+            // convert to USD as in get_fx_spot({ccy, USD})
+            pv += grid.get_book_value(node_rates.at(ccy)) * spots.at(ccy) /
+                  spots.at(CcyGroup::Currency::USD);
+        }
+        tape.backward(pv);
+
+        PVGradient gradient{pv.value, {}, {}};
+        for (auto& [ccy, rates] : currency_rates) {
+            auto& g = gradient.rates[ccy];
+            const auto& r = node_rates.at(ccy);
+            size_t i = 0;
+            for (int tenor : rates.get_tenors()) {
+                g.emplace(tenor, tape.get_adjoint(r[i++]));
+            }
+        }
+        for (auto& [ccy, spot] : spots) {
+            gradient.spots.emplace(ccy, tape.get_adjoint(spot));
+        }
+        return gradient;
     }
 
 #ifdef DEBUG
@@ -232,20 +1349,141 @@ class RiskManagementSystem {
     std::unordered_map<typename CcyGroup::Currency, DateNotionals>
         currency_notionals;
 
+    Tape tape;  // AAD arena, reused across calls
+
+    // Books with live risk, updated in place by rate ticks
+    std::unordered_map<typename CcyGroup::Currency, IncrementalBook> live_books;
+
+    // Limits of a currency by tenor (PV_LIMIT for the PV), laid out densely
+    // as the live risk: the PV then the DV01 to each node
+    struct CurrencyLimits {
+        std::map<int, double> by_tenor;
+        std::vector<int> tenors;  // of each slot
+        LimitBook book;
+        std::vector<double> values;
+    };
+    std::unordered_map<typename CcyGroup::Currency, CurrencyLimits> limits;
+    std::function<void(const LimitBreach&)> on_breach;
+
+    // Crosses of currency_spot, refreshed whenever a spot is set
+    FXMatrix<CcyGroup> fx_matrix;
+    CcyGroup::Currency reporting_ccy{CcyGroup::Currency::USD};
+
+    // Versions of each currency's curve, spot and trades, moved by every update
+    struct Versions {
+        uint64_t curve, fx, book;
+        bool operator==(const Versions&) const = default;
+    };
+    std::unordered_map<typename CcyGroup::Currency, uint64_t> curve_versions,
+        spot_versions, book_versions;
+
+    // DV01 results by query (no tenor for a parallel shift), with the versions
+    // of the inputs they were computed from. A query keeps only its latest
+    // result, so the cache is bounded by the number of distinct queries.
+    struct DV01Query {
+        typename CcyGroup::Currency ccy;
+        std::optional<int> tenor;
+        SensitivityMethod method;
+        BumpScheme scheme;
+        auto operator<=>(const DV01Query&) const = default;
+    };
+    std::map<DV01Query, std::pair<Versions, double>> DV01_cache;
+    // Standard buckets, and each curve's node allocation over them with the
+    // curve version
+    KeyRateBuckets key_rate_buckets;
+    std::unordered_map<
+        typename CcyGroup::Currency,
+        std::pair<uint64_t, std::vector<InterestRates::NodeWeights>>>
+        key_rate_allocations;
+    // Zero-to-par Jacobians of each curve, with the curve version
+    std::unordered_map<typename CcyGroup::Currency,
+                       std::pair<uint64_t, ParJacobian>>
+        par_jacobians;
+    // Unbumped book PVs in local ccy, the base of one-sided bumps
+    std::unordered_map<typename CcyGroup::Currency, std::pair<Versions, double>>
+        base_values;
+
+    // Delta-normal VaR state, with each currency's [begin, end) factors
+    std::optional<DeltaNormalVaR> parametric;
+    std::vector<RiskFactor> parametric_factors;
+    std::map<typename CcyGroup::Currency, std::pair<size_t, size_t>>
+        parametric_blocks;
+
     static constexpr double EPS{1e-4};  // or static inline
+    static constexpr double FX_EPS{1e-2};  // relative, i.e. a 1% spot move
+    static constexpr size_t MC_BLOCK{1024};  // Monte Carlo paths per job
+    static constexpr size_t GAMMA_CHUNK{256};  // cashflows per gamma job
+
+    // Shared by every parallel engine; a unique_ptr so set_threads can
+    // replace it
+    std::unique_ptr<ThreadPool> pool;
     int delta;  // no. of days from (Excel) 1900 epoch e.g. 4/29/2024 = 45410
 
-    void parse_rate(const std::string& line) {
+    // Reads a rates.txt-style file of curve and spot data into rates and spots
+    void load_market(
+        std::ifstream& in,
+        std::unordered_map<typename CcyGroup::Currency, InterestRates>& rates,
+        std::unordered_map<typename CcyGroup::Currency, FXSpot>& spots) {
+        std::string line;
+        std::getline(in, line);  // discard the first line starting with #
+
+        // e.g. IR.2W.EUR 0.025 (with thanks to https://regex101.com/)
+        static const std::regex rates_format{
+            R"(^IR\.[[:digit:]]+[[:upper:]]\.[[:upper:]]{3}[[:blank:]](?:[[:digit:]]+\.)?[[:digit:]]+$)"};
+
+        // e.g. FX.SPOT.EUR 1.1213 (always XXXUSD)
+        static const std::regex fx_format{
+            R"(^FX\.SPOT\.[[:upper:]]{3}[[:blank:]](?:[[:digit:]]+\.)?[[:digit:]]+$)"};
+
+        // https://stackoverflow.com/questions/36213659/how-to-sscanf-in-c
+        while (std::getline(in, line)) {
+            if (std::regex_search(line, rates_format)) {
+                parse_rate(line, rates);
+                continue;
+            }
+
+            if (std::regex_search(line, fx_format)) {
+                parse_fx(line, spots);
+                continue;
+            }
+            Log::warn_line(line);
+        }
+    }
+
+    void parse_rate(
+        const std::string& line,
+        std::unordered_map<typename CcyGroup::Currency, InterestRates>& rates) {
         Log::info_rate(line);
         std::istringstream s_line{line};
         std::string key_param;
         std::getline(s_line, key_param, '.');  // "IR", we ignore
 
         std::getline(s_line, key_param, '.');  // "2W"
-        char name{key_param.back()};           // "W"
-        key_param.pop_back();                  // "2"
+        auto tenor_opt = parse_tenor(key_param);
+        if (!tenor_opt) return;
+        int tenor{*tenor_opt};
+
+        s_line >> key_param;  // "EUR"
+        auto ccy_opt = CcyGroup::to_ccy(key_param);
+        if (!ccy_opt) {
+            Log::warn_ccy_str(key_param);
+            return;
+        }
+        typename CcyGroup::Currency ccy = *ccy_opt;
+
+        double rate;
+        s_line >> rate;  // 0.025
+
+        // we default-construct a InterestRates if this is the first data point
+        rates[ccy].add_rate(tenor, rate);
+    }
+
+    // e.g. "2W" is 14 days
+    std::optional<int> parse_tenor(std::string key_param) {
+        char name{key_param.back()};  // "W"
+        key_param.pop_back();         // "2"
         int tenor{std::stoi(key_param)};
-        if (!check_tenor_val(tenor)) return;
+        if (!check_tenor_val(tenor)) return {};
         switch (name) {
             case 'D':
                 tenor *= 1;
@@ -260,26 +1498,36 @@ class RiskManagementSystem {
                 tenor *= 360;
                 break;
             default:
-                Log::warn_tenor_char(tenor);
-                return;
+                Log::warn_tenor_char(name);
+                return {};
         }
+        return tenor;
+    }
 
-        s_line >> key_param;  // "EUR"
-        auto ccy_opt = CcyGroup::to_ccy(key_param);
+    // e.g. IR.2W.EUR or FX.SPOT.EUR, as in rates.txt
+    std::optional<RiskFactor> parse_factor(const std::string& name) {
+        static const std::regex factor_format{
+            R"(^(?:IR\.[[:digit:]]+[DWMY]|FX\.SPOT)\.[[:upper:]]{3}$)"};
+        if (!std::regex_search(name, factor_format)) return {};
+        std::istringstream s_name{name};
+        std::string kind, tenor_str, ccy_str;
+        std::getline(s_name, kind, '.');
+        std::getline(s_name, tenor_str, '.');
+        std::getline(s_name, ccy_str);
+        auto ccy_opt = CcyGroup::to_ccy(ccy_str);
         if (!ccy_opt) {
-            Log::warn_ccy_str(key_param);
-            return;
+            Log::warn_ccy_str(ccy_str);
+            return {};
         }
-        typename CcyGroup::Currency ccy = *ccy_opt;
-
-        double rate;
-        s_line >> rate;  // 0.025
-
-        // we default-construct a InterestRates if this is the first data point
-        currency_rates[ccy].add_rate(tenor, rate);
+        if (kind == "FX") return RiskFactor{*ccy_opt, SPOT};
+        auto tenor_opt = parse_tenor(tenor_str);
+        if (!tenor_opt) return {};
+        return RiskFactor{*ccy_opt, *tenor_opt};
     }
 
-    void parse_fx(const std::string& line) {
+    void parse_fx(
+        const std::string& line,
+        std::unordered_map<typename CcyGroup::Currency, FXSpot>& spots) {
         Log::info_fx(line);
         std::istringstream s_line{line};
         std::string key_param;
@@ -298,38 +1546,546 @@ class RiskManagementSystem {
         s_line >> spot;
 
         // default construct FXSpot object if necessary
-        currency_spot[ccy].set_spot(spot);
+        spots[ccy].set_spot(spot);
     }
 
-    void parse_trade(const std::string& line) {
-        Log::info_trade(line);
+    // The fields of one portfolio.txt line, before they are checked
+    struct TradeLine {
+        int notional;
+        std::string ccy_str;
+        int payment_date;
+    };
+
+    // Touches no state (or log), so lines can be read concurrently. RETURNS
+    // nothing if the line is not a trade.
+    static std::optional<TradeLine> read_trade(const std::string& line) {
+        static const std::regex trade_format{
+            R"(^[[:digit:]]+;[a-f0-9]{8};[[:upper:]]{3};[[:digit:]]{5};$)"};
+        if (!std::regex_search(line, trade_format)) return {};
+
         std::istringstream s_line{line};
         std::string key_param;
         std::getline(s_line, key_param, ';');  // id, we ignore
 
+        TradeLine trade;
         std::getline(s_line, key_param, ';');  // notional
-        int notional;
-        std::istringstream{key_param} >> std::hex >> notional;
+        std::istringstream{key_param} >> std::hex >> trade.notional;
 
-        std::getline(s_line, key_param, ';');  // ccy
-        auto ccy_opt = CcyGroup::to_ccy(key_param);
+        std::getline(s_line, trade.ccy_str, ';');  // ccy
+        s_line >> trade.payment_date;
+        return trade;
+    }
+
+    void book_trade(const std::string& line, const TradeLine& trade) {
+        Log::info_trade(line);
+        auto ccy_opt = CcyGroup::to_ccy(trade.ccy_str);
         if (!ccy_opt) {
-            Log::warn_ccy_str(key_param);
+            Log::warn_ccy_str(trade.ccy_str);
             return;
         }
         typename CcyGroup::Currency ccy = *ccy_opt;
 
-        int payment_date;
-        s_line >> payment_date;
-        int tenor = payment_date - delta;
+        int tenor = trade.payment_date - delta;
         if (!check_tenor_val(tenor)) return;
-        Log::info_effective_tenor_notional(tenor, notional);
+        Log::info_effective_tenor_notional(tenor, trade.notional);
+        add_trade(ccy, trade.payment_date, trade.notional);
+    }
 
-        if (!currency_notionals.contains(ccy)) {
-            // default construct DateNotionals object
-            currency_notionals[ccy].set_delta(delta);
+    // REQUIRES the factor to exist in today's market
+    double get_factor_value(const RiskFactor& factor) {
+        if (factor.tenor == SPOT) {
+            return currency_spot.at(factor.ccy).get_spot();
         }
-        currency_notionals.at(ccy).add_trade(payment_date, notional);
+        return currency_rates.at(factor.ccy).get_rate(factor.tenor);
+    }
+
+    // A book prepared for scenario valuation: its cashflow grid with the base
+    // PV of each cashflow, and the columns of its curve nodes and spot among
+    // the scenario factors (-1 if absent)
+    struct ScenarioBook {
+        typename CcyGroup::Currency ccy;
+        CashflowGrid grid;
+        std::vector<double> base_pvs;
+        std::vector<int> node_columns;
+        int fx_column{-1};
+        double spot{1.0};
+    };
+
+    std::vector<ScenarioBook> get_scenario_books(
+        const std::vector<RiskFactor>& factors) {
+        std::map<RiskFactor, int> columns;
+        for (size_t f = 0; f < factors.size(); ++f) {
+            columns.emplace(factors[f], static_cast<int>(f));
+        }
+        auto get_column = [&columns](const RiskFactor& factor) {
+            auto it = columns.find(factor);
+            return it == columns.end() ? -1 : it->second;
+        };
+        std::vector<ScenarioBook> books;
+        for (auto& [ccy, book] : currency_notionals) {
+            if (!check_rates(ccy) || !check_fx(ccy)) continue;
+            ScenarioBook sb{ccy, {currency_rates.at(ccy), book}, {}, {}, -1,
+                            get_usd_conversion(ccy)};
+            for (size_t j = 0; j < sb.grid.size(); ++j) {
+                sb.base_pvs.push_back(
+                    sb.grid.notionals[j] *
+                    sb.grid.get_discount_factor(j, sb.grid.rates));
+            }
+            for (int tenor : sb.grid.tenors) {
+                sb.node_columns.push_back(get_column({ccy, tenor}));
+            }
+            if (ccy != CcyGroup::Currency::USD) {
+                sb.fx_column = get_column({ccy, SPOT});
+            }
+            books.push_back(std::move(sb));
+        }
+        return books;
+    }
+
+    // Writes to pnl[b][s] the P&L in USD of books[b] under the n scenarios in
+    // the row-major n x n_factors matrix shifts. All scenarios are valued in
+    // one sweep over the cashflows: the base discount factor of a cashflow is
+    // known and each scenario only multiplies in
+    // exp(-(w_left * shift_left + w_right * shift_right) * t / 360), in an
+    // inner loop over contiguous per-node shift vectors. Thread safe.
+    static void value_scenarios(const std::vector<ScenarioBook>& books,
+                                const double* shifts, size_t n,
+                                size_t n_factors,
+                                std::vector<std::vector<double>>& pnl) {
+        pnl.resize(books.size());
+        for (size_t b = 0; b < books.size(); ++b) {
+            value_scenarios(books[b], shifts, n, n_factors, pnl[b]);
+        }
+    }
+
+    // Same, with one job per book on the pool
+    static void value_scenarios(ThreadPool& pool,
+                                const std::vector<ScenarioBook>& books,
+                                const double* shifts, size_t n,
+                                size_t n_factors,
+                                std::vector<std::vector<double>>& pnl) {
+        pnl.resize(books.size());
+        pool.parallel_for(
+            books.size(), [&books, shifts, n, n_factors, &pnl](size_t b) {
+                value_scenarios(books[b], shifts, n, n_factors, pnl[b]);
+            });
+    }
+
+    static void value_scenarios(const ScenarioBook& sb, const double* shifts,
+                                size_t n, size_t n_factors,
+                                std::vector<double>& book_pnl) {
+        const auto& grid = sb.grid;
+        std::vector<double> no_shift(n, 0.0), pv(n, 0.0);
+        std::vector<std::vector<double>> node_shifts(sb.node_columns.size());
+        for (size_t i = 0; i < sb.node_columns.size(); ++i) {
+            node_shifts[i].assign(n, 0.0);
+            int column{sb.node_columns[i]};
+            if (column < 0) continue;
+            for (size_t s = 0; s < n; ++s) {
+                node_shifts[i][s] = shifts[s * n_factors + column];
+            }
+        }
+
+        double base_pv{0.0};
+        for (size_t j = 0; j < grid.size(); ++j) {
+            const auto& nw = grid.weights[j];
+            double t{grid.times[j] / 360.0};
+            double c{sb.base_pvs[j]};
+            double a_left{-nw.w_left * t}, a_right{-nw.w_right * t};
+            const double* d_left{nw.left >= 0 ? node_shifts[nw.left].data()
+                                              : no_shift.data()};
+            const double* d_right{nw.right >= 0 ? node_shifts[nw.right].data()
+                                                : no_shift.data()};
+            double* out{pv.data()};
+            for (size_t s = 0; s < n; ++s) {
+                out[s] +=
+                    c * std::exp(a_left * d_left[s] + a_right * d_right[s]);
+            }
+            base_pv += c;
+        }
+
+        book_pnl.resize(n);
+        double fx{0.0};
+        for (size_t s = 0; s < n; ++s) {
+            if (sb.fx_column >= 0) fx = shifts[s * n_factors + sb.fx_column];
+            book_pnl[s] = pv[s] * sb.spot * (1 + fx) - base_pv * sb.spot;
+        }
+    }
+
+    // P&L in USD of the book in each currency under each scenario
+    std::map<typename CcyGroup::Currency, std::vector<double>> get_scenario_pnl(
+        const Scenarios& scenarios) {
+        auto books = get_scenario_books(scenarios.factors);
+        std::vector<std::vector<double>> pnl;
+        value_scenarios(*pool, books, scenarios.shifts.data(), scenarios.size(),
+                        scenarios.factors.size(), pnl);
+        std::map<typename CcyGroup::Currency, std::vector<double>> result;
+        for (size_t b = 0; b < books.size(); ++b) {
+            result.emplace(books[b].ccy, std::move(pnl[b]));
+        }
+        return result;
+    }
+
+    // Simulates n_paths correlated factor moves and streams the P&L of each
+    // book on each path into a mergeable accumulator (make_tail() creates one,
+    // push(tail, pnl) adds a path). Paths are generated and valued in blocks
+    // on the pool, each block with its own counter-based stream, and
+    // block accumulators are merged in block order, so results do not depend
+    // on the thread count. Blocks run in waves so that at most a few
+    // accumulators per thread are alive.
+    template <typename MakeTail, typename Push>
+    static auto simulate_MC(ThreadPool& pool,
+                            const std::vector<ScenarioBook>& books,
+                            const Covariance& covariance, size_t n_paths,
+                            uint64_t seed, MakeTail make_tail, Push push) {
+        using Tail = std::invoke_result_t<MakeTail>;
+        const CholeskyFactor cholesky{covariance.matrix};
+        size_t n_factors{covariance.factors.size()};
+
+        // RETURNS the accumulator of one block of paths
+        auto run_block = [&books, &cholesky, n_factors, n_paths, seed,
+                          &make_tail, &push](size_t block) {
+            size_t first{block * MC_BLOCK};
+            size_t n{std::min(MC_BLOCK, n_paths - first)};
+            CounterRNG rng{seed, block};
+            std::vector<double> z(n_factors), shifts(n * n_factors);
+            for (size_t p = 0; p < n; ++p) {
+                for (size_t f = 0; f < n_factors; ++f) {
+                    z[f] = rng.normal(p * n_factors + f);
+                }
+                cholesky.multiply(z.data(), shifts.data() + p * n_factors);
+            }
+            std::vector<std::vector<double>> pnl;
+            value_scenarios(books, shifts.data(), n, n_factors, pnl);
+            Tail tail{make_tail()};
+            std::vector<double> path_pnl(books.size());
+            for (size_t p = 0; p < n; ++p) {
+                for (size_t b = 0; b < books.size(); ++b) {
+                    path_pnl[b] = pnl[b][p];
+                }
+                push(tail, path_pnl);
+            }
+            return tail;
+        };
+
+        Tail tail{make_tail()};
+        size_t n_blocks{(n_paths + MC_BLOCK - 1) / MC_BLOCK};
+        size_t wave{2 * pool.size()};
+        for (size_t begin = 0; begin < n_blocks; begin += wave) {
+            auto tails = pool.parallel_map(
+                std::min(wave, n_blocks - begin),
+                [&run_block, begin](size_t b) { return run_block(begin + b); });
+            for (auto& block_tail : tails) tail.merge(std::move(block_tail));
+        }
+        return tail;
+    }
+
+    // VaR is the k-th worst loss for k = (1 - confidence) * scenarios (rounded
+    // up) and ES the average of the k worst, with contributions taken from the
+    // same scenarios
+    VaRResult get_tail_risk(
+        const std::map<typename CcyGroup::Currency, std::vector<double>>& pnl,
+        double confidence) {
+        VaRResult result;
+        if (pnl.empty() || pnl.begin()->second.empty()) return result;
+        size_t n{pnl.begin()->second.size()};
+        std::vector<double> total(n, 0.0);
+        for (auto& [ccy, ccy_pnl] : pnl) {
+            for (size_t s = 0; s < n; ++s) total[s] += ccy_pnl[s];
+        }
+        // guard against e.g. (1 - 0.99) * 500 = 5.000000000000004
+        size_t k{static_cast<size_t>(std::ceil((1 - confidence) * n - 1e-9))};
+        k = std::clamp<size_t>(k, 1, n);
+        std::vector<size_t> worst(n);
+        std::iota(worst.begin(), worst.end(), 0);
+        std::ranges::nth_element(worst, worst.begin() + (k - 1),
+                                 [&total](size_t a, size_t b) {
+                                     return total[a] < total[b];
+                                 });
+        size_t var_scenario{worst[k - 1]};
+        result.VaR = -total[var_scenario];
+        for (size_t i = 0; i < k; ++i) result.ES -= total[worst[i]] / k;
+        for (auto& [ccy, ccy_pnl] : pnl) {
+            result.VaR_contributions[ccy] = -ccy_pnl[var_scenario];
+            double es{0.0};
+            for (size_t i = 0; i < k; ++i) es -= ccy_pnl[worst[i]] / k;
+            result.ES_contributions[ccy] = es;
+        }
+        return result;
+    }
+
+    // The FX version covers both spots of the conversion to the reporting ccy
+    // (the sum of two counters that only go up changes whenever either does)
+    Versions get_versions(CcyGroup::Currency ccy) {
+        return {curve_versions[ccy],
+                spot_versions[ccy] + spot_versions[reporting_ccy],
+                book_versions[ccy]};
+    }
+
+    // A cached DV01 if none of its inputs changed since it was computed
+    std::optional<double> get_cached_DV01(const DV01Query& query) {
+        auto it = DV01_cache.find(query);
+        if (it == DV01_cache.end()) return {};
+        auto& [versions, dv01] = it->second;
+        if (versions != get_versions(query.ccy)) return {};
+        return dv01;
+    }
+    std::optional<double> cache_DV01(const DV01Query& query, double dv01) {
+        DV01_cache.insert_or_assign(query,
+                                    std::pair{get_versions(query.ccy), dv01});
+        return std::make_optional(dv01);
+    }
+
+    // DV01 in the reporting ccy of the book in ccy by bump and revalue, for a
+    // bump to one tenor or (without a tenor) the whole curve. Sensitivities
+    // are scaled to a bump of EPS in the units of the scheme: absolute schemes
+    // all estimate the DV01, and relative ones the DV01 times the rate of the
+    // bumped node(s). REQUIRES rates and spot for ccy, and a valid scheme
+    double get_bumped_DV01(CcyGroup::Currency ccy, std::optional<int> tenor,
+                           const BumpScheme& scheme) {
+        if (!check_maturities(ccy)) return 0.0;
+        auto& rates = currency_rates.at(ccy);
+        auto& trades = currency_notionals.at(ccy);
+
+        // bump the curve in its own scope so it gets unbumped when we exit
+        auto get_bumped_value = [&rates, &trades, &tenor,
+                                 &scheme](double bump) {
+            auto unbump_later = [&] {
+                if (!tenor) return rates.bump_curve(bump, scheme.relative);
+                double rate{rates.get_rate(*tenor)};
+                return rates.bump_tenor(*tenor,
+                                        scheme.relative ? rate * bump : bump);
+            }();
+            auto discount_fn = [&rates](int tenor) {
+                return rates.get_discount_factor(tenor);
+            };
+            return trades.get_book_value(discount_fn);
+        };
+
+        double h{scheme.size}, dv01{0.0};
+        switch (scheme.direction) {
+            case BumpDirection::Central:  // 2nd-order approx
+                dv01 = -(get_bumped_value(h) - get_bumped_value(-h)) / 2;
+                break;
+            case BumpDirection::Forward:
+                dv01 = -(get_bumped_value(h) - get_base_value(ccy));
+                break;
+            case BumpDirection::Backward:
+                dv01 = -(get_base_value(ccy) - get_bumped_value(-h));
+                break;
+        }
+        // Convert sensitivity to local rates to the reporting ccy
+        return get_reporting_conversion(ccy) * dv01 * (EPS / h);
+    }
+
+    // Local-currency DV01s of the cashflows of grid, accumulated over n_out
+    // outputs: node i of the curve contributes to output allocation[i].left
+    // and .right with their weights. The identity allocation gives the node
+    // ladder. Analytic mode differentiates the interpolation, otherwise each
+    // node is bumped by EPS both ways for the cashflows around it.
+    static std::vector<double> get_ladder(
+        const CashflowGrid& grid, SensitivityMethod method,
+        const std::vector<InterestRates::NodeWeights>& allocation,
+        size_t n_out) {
+        std::vector<double> ladder(n_out, 0.0);
+        auto add_node = [&ladder, &allocation, method](
+                            int node, double weight, double notional, double r,
+                            double t) {
+            if (node < 0 || weight == 0.0) return;
+            double dv01;
+            if (method == SensitivityMethod::Analytic) {
+                // -dPV/dr_i scaled to a bump of EPS
+                dv01 = notional * weight * t / 360 * std::exp(-r * t / 360) *
+                       EPS;
+            } else {
+                double up{std::exp(-(r + weight * EPS) * t / 360)};
+                double down{std::exp(-(r - weight * EPS) * t / 360)};
+                dv01 = -notional * (up - down) / 2;  // 2nd-order approx
+            }
+            const auto& to = allocation[node];
+            if (to.left >= 0) ladder[to.left] += to.w_left * dv01;
+            if (to.right >= 0) ladder[to.right] += to.w_right * dv01;
+        };
+        for (size_t j = 0; j < grid.size(); ++j) {
+            const auto& nw = grid.weights[j];
+            double r{grid.get_rate(j, grid.rates)};
+            double t{static_cast<double>(grid.times[j])};
+            add_node(nw.left, nw.w_left, grid.notionals[j], r, t);
+            add_node(nw.right, nw.w_right, grid.notionals[j], r, t);
+        }
+        return ladder;
+    }
+
+    // Answers the queries of one currency with rates (see run_queries).
+    // Reads shared state only and does not log, so groups run in parallel
+    void answer_queries(CcyGroup::Currency ccy, bool has_fx, double fx,
+                        std::span<const RiskQuery> queries,
+                        std::span<std::optional<double>> answers) const {
+        const auto& rates = currency_rates.at(ccy);
+        CashflowGrid grid{rates,
+                          check_maturities(ccy)
+                              ? currency_notionals.at(ccy).get_cashflows()
+                              : std::vector<std::pair<int, int>>{}};
+        std::vector<double> ladder;  // swept on the first tenor DV01
+        for (size_t q = 0; q < queries.size(); ++q) {
+            auto [kind, _, tenor] = queries[q];
+            if (kind == QueryKind::DiscountFactor) {
+                if (tenor >= 0) answers[q] = rates.get_discount_factor(tenor);
+                continue;
+            }
+            if (!has_fx) continue;
+            if (kind == QueryKind::PV) {
+                answers[q] = fx * grid.get_book_value(grid.rates);
+            } else if (kind == QueryKind::ParallelDV01) {
+                auto bumped = [&grid](double bump) {
+                    auto r = grid.rates;
+                    for (double& rate : r) rate += bump;
+                    return grid.get_book_value(r);
+                };
+                answers[q] = fx * -(bumped(EPS) - bumped(-EPS)) / 2;
+            } else if (rates.check_tenor(tenor)) {
+                if (ladder.empty()) {
+                    size_t n{grid.tenors.size()};
+                    ladder = get_ladder(grid,
+                                        SensitivityMethod::CentralDifference,
+                                        get_node_allocation(n), n);
+                }
+                size_t i = std::ranges::lower_bound(grid.tenors, tenor) -
+                           grid.tenors.begin();
+                answers[q] = fx * ladder[i];
+            }
+        }
+    }
+
+    // REQUIRES rates for ccy
+    IncrementalBook& get_live_book(CcyGroup::Currency ccy) {
+        auto it = live_books.find(ccy);
+        if (it == live_books.end()) {
+            it = live_books.emplace(ccy, IncrementalBook{get_grid(ccy), EPS})
+                     .first;
+        }
+        return it->second;
+    }
+
+    bool set_limit(CcyGroup::Currency ccy, int tenor, double limit) {
+        Log::info_limit(CcyGroup::to_string(ccy), tenor, limit);
+        auto& ccy_limits = limits[ccy];
+        ccy_limits.by_tenor.insert_or_assign(tenor, limit);
+        ccy_limits.tenors.clear();  // lay out again on the next check
+        return true;
+    }
+
+    // Lays out the limits of a currency over its current curve nodes; limits
+    // on tenors that are no longer nodes are kept for when they return
+    static void set_limit_slots(CurrencyLimits& limit,
+                                const std::vector<int>& tenors) {
+        limit.tenors.assign(1, PV_LIMIT);
+        limit.tenors.insert(limit.tenors.end(), tenors.begin(), tenors.end());
+        limit.book = LimitBook{limit.tenors.size()};
+        limit.values.assign(limit.tenors.size(), 0.0);
+        for (size_t i = 0; i < limit.tenors.size(); ++i) {
+            if (auto it = limit.by_tenor.find(limit.tenors[i]);
+                it != limit.by_tenor.end()) {
+                limit.book.set_limit(i, it->second);
+            }
+        }
+    }
+
+    // Identity allocation of n nodes: get_ladder then gives the node ladder
+    static std::vector<InterestRates::NodeWeights> get_node_allocation(
+        size_t n) {
+        std::vector<InterestRates::NodeWeights> nodes(n);
+        for (size_t i = 0; i < n; ++i) {
+            nodes[i] = {static_cast<int>(i), -1, 1.0, 0.0};
+        }
+        return nodes;
+    }
+
+    // REQUIRES rates for ccy
+    const std::vector<InterestRates::NodeWeights>& get_key_rate_allocation(
+        CcyGroup::Currency ccy) {
+        uint64_t version{curve_versions[ccy]};
+        auto it = key_rate_allocations.find(ccy);
+        if (it == key_rate_allocations.end() || it->second.first != version) {
+            auto k = currency_rates.at(ccy).get_tenors();
+            auto allocation = key_rate_buckets.get_allocation(
+                std::vector<int>(k.begin(), k.end()));
+            std::pair entry{version, std::move(allocation)};
+            it = key_rate_allocations.insert_or_assign(ccy, std::move(entry))
+                     .first;
+        }
+        return it->second.second;
+    }
+
+    // REQUIRES rates for ccy
+    const ParJacobian& get_par_jacobian(CcyGroup::Currency ccy) {
+        uint64_t version{curve_versions[ccy]};
+        auto it = par_jacobians.find(ccy);
+        if (it == par_jacobians.end() || it->second.first != version) {
+            std::pair entry{version, ParJacobian{currency_rates.at(ccy)}};
+            it = par_jacobians.insert_or_assign(ccy, std::move(entry)).first;
+        }
+        return it->second.second;
+    }
+
+    // Book PV in local ccy, valued as in get_bumped_DV01 and cached until the
+    // curve or the trades change. REQUIRES rates and trades for ccy
+    double get_base_value(CcyGroup::Currency ccy) {
+        auto versions = get_versions(ccy);
+        if (auto it = base_values.find(ccy); it != base_values.end()) {
+            auto& [cached, value] = it->second;
+            if (cached.curve == versions.curve &&
+                cached.book == versions.book) {
+                return value;
+            }
+        }
+        auto& rates = currency_rates.at(ccy);
+        auto discount_fn = [&rates](int tenor) {
+            return rates.get_discount_factor(tenor);
+        };
+        double value{currency_notionals.at(ccy).get_book_value(discount_fn)};
+        base_values.insert_or_assign(ccy, std::pair{versions, value});
+        return value;
+    }
+
+    // Factor converting amounts in ccy to USD, i.e. the CCYUSD spot, which
+    // is the numeraire of scenario P&L. Spots are stored as CCYUSD, so the
+    // USDCCY cross get_fx_spot({USD, ccy}) would invert the conversion.
+    // REQUIRES spot for ccy
+    double get_usd_conversion(CcyGroup::Currency ccy) {
+        return fx_matrix.at(ccy, CcyGroup::Currency::USD);
+    }
+
+    // Factor converting amounts in ccy to the reporting currency.
+    // REQUIRES spot for ccy
+    double get_reporting_conversion(CcyGroup::Currency ccy) {
+        return fx_matrix.at(ccy, reporting_ccy);
+    }
+
+    // REQUIRES rates for ccy; a currency without trades has an empty grid
+    CashflowGrid get_grid(CcyGroup::Currency ccy) {
+        if (!check_maturities(ccy)) {
+            return {currency_rates.at(ccy), std::vector<std::pair<int, int>>{}};
+        }
+        return {currency_rates.at(ccy), currency_notionals.at(ccy)};
+    }
+
+    // The currencies with trades, rates and spot, and their cashflow grids,
+    // built (and any warnings logged) before jobs are sent to the pool
+    std::pair<std::vector<typename CcyGroup::Currency>,
+              std::vector<CashflowGrid>>
+    get_priced_grids() {
+        std::pair<std::vector<typename CcyGroup::Currency>,
+                  std::vector<CashflowGrid>>
+            result;
+        for (auto& [ccy, trades] : currency_notionals) {
+            if (!currency_rates.contains(ccy) || !currency_spot.contains(ccy)) {
+                continue;
+            }
+            result.first.push_back(ccy);
+            result.second.push_back(get_grid(ccy));
+        }
+        return result;
     }
 
     ///////////////////////// ERROR-CHECKING CODE /////////////////////////////
@@ -347,7 +2103,7 @@ class RiskManagementSystem {
         }
         return true;
     }
-    bool check_maturities(CcyGroup::Currency ccy) {
+    bool check_maturities(CcyGroup::Currency ccy) const {
         return currency_notionals.contains(ccy);
     }
     bool check_tenor_val(int tenor) {
@@ -374,4 +2130,11 @@ class RiskManagementSystem {
         }
         return true;
     }
+    bool check_bump_scheme(const BumpScheme& scheme) {
+        if (!std::isfinite(scheme.size) || scheme.size <= 0) {
+            Log::warn_bump_size(scheme.size);
+            return false;
+        }
+        return true;
+    }
 };
@@ -1,13 +1,20 @@
 #include <algorithm>
 #include <array>
 #include <cmath>  // std::exp
+#include <cstdint>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <numbers>  // pi
 #include <numeric>  //reduce
 #include <optional>
 #include <ranges>
+#include <sstream>
+#include <string>
+#include <unordered_map>
 
+#include "aad.h"
 #include "logger.h"
 /*
     A base group of currencies on which we build our risk management system.
@@ -46,6 +53,32 @@ struct G5 {
     // https://www.learncpp.com/cpp-tutorial/static-member-variables/
     static inline const std::array<std::string, 5> strings{"EUR", "GBP", "USD",
                                                            "CAD", "JPY"};
+
+   public:
+    static constexpr size_t n_currencies{strings.size()};
+};
+
+/*
+    How sensitivities are computed: by bumping the inputs and revaluing (with
+    central differences unless a BumpScheme says otherwise), or exactly from
+    the closed-form derivatives of the valuation (which needs one pass and has
+    no truncation error).
+*/
+enum class SensitivityMethod { CentralDifference, Analytic };
+
+/*
+    How a curve is bumped for a finite-difference sensitivity: up and down
+    (central, second-order accurate, two revaluations) or only up or down
+    (forward / backward, one revaluation against the unbumped PV), by size
+    in rate units or, if relative, by size times each rate. The size must be
+    positive and finite.
+*/
+enum class BumpDirection { Central, Forward, Backward };
+struct BumpScheme {
+    BumpDirection direction{BumpDirection::Central};
+    double size{1e-4};
+    bool relative{false};
+    auto operator<=>(const BumpScheme&) const = default;
 };
 
 /*
@@ -56,7 +89,7 @@ struct G5 {
     unless we abbreviate everything with auto.
 */
 struct InterestRates {
-    bool check_tenor(int tenor) { return rates.contains(tenor); }
+    bool check_tenor(int tenor) const { return rates.contains(tenor); }
 
     // The goal is to specify the return type as a view of the type of the rates
     // object, without specifying the object's type. For this, r must be
@@ -99,6 +132,24 @@ struct InterestRates {
         return std::exp(-r_eff * t / 360);
     }
 
+    // The interpolated rate above is r_t = w_left * r_left + w_right * r_right,
+    // so bumping one node by h moves r_t by (its weight) * h and leaves every
+    // t outside the node's neighbouring segments untouched. Nodes are indexed
+    // in the order of get_tenors(); the origin (0, 0.0) is not a node (-1).
+    struct NodeWeights {
+        int left{-1}, right{-1};
+        double w_left{0.0}, w_right{0.0};
+    };
+
+    // Node rates in the order of get_tenors()
+    std::vector<double> get_rates() const {
+        auto v = std::views::values(rates);
+        return std::vector<double>(v.begin(), v.end());
+    }
+
+    // REQUIRES tenor to exist
+    double get_rate(int tenor) const { return rates.at(tenor); }
+
     // Overwrites by default
     void add_rate(int tenor, double rate) {
         rates.insert_or_assign(tenor, rate);
@@ -111,28 +162,35 @@ struct InterestRates {
     };
 
     // REQUIRES tenor to exist, RETURNS finally
+    // Unbumping restores the saved rate: (r + h) - h need not equal r in
+    // floating point, and repeated bumps would otherwise drift the curve
     [[nodiscard]] finally bump_tenor(int tenor, double bump_amount) {
         Log::info_bump_tenor(tenor, bump_amount);
+        double saved{rates.at(tenor)};
         rates.at(tenor) += bump_amount;
         return {[=, this]() {  // capturing local vars by reference can cause UB
             Log::info_unbump_tenor(tenor, bump_amount);
-            rates.at(tenor) -= bump_amount;
+            rates.at(tenor) = saved;
         }};
     }
 
-    // RETURNS finally
-    [[nodiscard]] finally bump_curve(double bump_amount) {
+    // Moves every node by bump_amount, or by bump_amount times its rate if
+    // relative. RETURNS finally
+    [[nodiscard]] finally bump_curve(double bump_amount,
+                                     bool relative = false) {
         Log::info_bump_curve(bump_amount);
+        auto saved = rates;
         for (auto const& tenor : get_tenors()) {
-            Log::info_bump_tenor(tenor, bump_amount);
-            rates.at(tenor) += bump_amount;
+            double bump{relative ? rates.at(tenor) * bump_amount : bump_amount};
+            Log::info_bump_tenor(tenor, bump);
+            rates.at(tenor) += bump;
         }
         return {[=, this]() {  // capturing local vars by reference can cause UB
             Log::info_unbump_curve(bump_amount);
             for (auto const& tenor : get_tenors()) {
                 Log::info_unbump_tenor(tenor, bump_amount);
-                rates.at(tenor) -= bump_amount;
             }
+            rates = saved;
         }};
     }
 #ifdef DEBUG
@@ -155,34 +213,105 @@ struct FXSpot {
     void set_spot(double s) { spot = s; }
     double get_spot() const { return spot; }
 
+    // Relative bump, e.g. 0.01 moves the spot up by 1%. RETURNS finally
+    [[nodiscard]] InterestRates::finally bump_spot(double bump_amount) {
+        Log::info_bump_spot(bump_amount);
+        double saved{spot};
+        spot *= 1 + bump_amount;
+        return {[=, this]() {
+            Log::info_unbump_spot(bump_amount);
+            spot = saved;
+        }};
+    }
+
    private:
     double spot{1.0};  // defaults to 1 for USD
 };
 
+/*
+    Dense matrix of the FX crosses between all currencies of a group, built
+    from their XXXUSD spots (NaN where a spot is missing). Each row holds the
+    rates into one currency, so converting amounts in every currency into it
+    is one elementwise multiply by a contiguous row.
+*/
+template <typename CcyGroup>
+struct FXMatrix {
+    using Currency = typename CcyGroup::Currency;
+    static constexpr size_t N{CcyGroup::n_currencies};
+    using Amounts = std::array<double, N>;  // indexed by currency
+
+    void refresh(const std::unordered_map<Currency, FXSpot>& spots) {
+        Amounts usd;
+        usd.fill(std::numeric_limits<double>::quiet_NaN());
+        for (auto& [ccy, fx] : spots) usd[index(ccy)] = fx.get_spot();
+        for (size_t to = 0; to < N; ++to) {
+            for (size_t from = 0; from < N; ++from) {
+                rates[to * N + from] = usd[from] / usd[to];
+            }
+        }
+    }
+
+    // Units of to per unit of from
+    double at(Currency from, Currency to) const {
+        return rates[index(to) * N + index(from)];
+    }
+
+    // Amounts in each currency converted into to
+    Amounts convert(const Amounts& amounts, Currency to) const {
+        Amounts converted;
+        const double* row{rates.data() + index(to) * N};
+        for (size_t from = 0; from < N; ++from) {
+            converted[from] = amounts[from] * row[from];
+        }
+        return converted;
+    }
+
+    static size_t index(Currency ccy) { return static_cast<size_t>(ccy); }
+
+   private:
+    std::array<double, N * N> rates{};
+};
+
 /* Maintains a list of maturity dates and the notionals on those dates*/
 struct DateNotionals {
     // std::ranges::keys_view<std::views::all_t<decltype((date_notionals))>>
     auto get_maturities() const { return std::views::keys(date_notionals); }
 
-    double get_book_value(const std::function<double(int)>& discount_factors) {
+    // Logging is off when called from worker threads: the log streams are
+    // not synchronised
+    double get_book_value(const std::function<double(int)>& discount_factors,
+                          bool verbose = true) const {
         std::vector<double> pvs(date_notionals.size());
-        Log::info_date_notionals();
+        if (verbose) Log::info_date_notionals();
         // map-reduce
         std::transform(
             date_notionals.begin(), date_notionals.end(), pvs.begin(),
-            [&discount_factors,
-             delta = this->delta](std::pair<int, int> kv) -> double {
+            [&discount_factors, delta = this->delta,
+             verbose](std::pair<int, int> kv) -> double {
                 auto& [date, notional] = kv;
                 int eff_date{date - delta};
                 double df{discount_factors(eff_date)};  // don't declare as int!
-                Log::info_date_notionals_line(eff_date, notional, df);
+                if (verbose) {
+                    Log::info_date_notionals_line(eff_date, notional, df);
+                }
                 return notional * df;
             });
         double total = std::reduce(pvs.begin(), pvs.end());
-        Log::info_book_value(total);
+        if (verbose) Log::info_book_value(total);
         return total;
     }
 
+    // Effective dates (date - delta) and notionals, sorted by date
+    std::vector<std::pair<int, int>> get_cashflows() const {
+        std::vector<std::pair<int, int>> cashflows;
+        cashflows.reserve(date_notionals.size());
+        for (auto& [date, notional] : date_notionals) {
+            cashflows.emplace_back(date - delta, notional);
+        }
+        std::ranges::sort(cashflows);
+        return cashflows;
+    }
+
     void add_trade(int date, int notional) { date_notionals[date] += notional; }
 
     void set_delta(int d) { delta = d; }
@@ -191,3 +320,843 @@ struct DateNotionals {
     std::unordered_map<int, int> date_notionals;
     int delta{0};  // can roll, delete matured trades etc...
 };
+
+/*
+    A declarative stress scenario: a parallel shift of every curve, a twist
+    that moves the short and long ends by different amounts, or a relative
+    move of every XXXUSD spot. Twists follow the shape of the Basel IRRBB
+    shocks: shift(t) = short * exp(-t / 4Y) + long * (1 - exp(-t / 4Y)).
+    A twist takes the short and long shifts in bp, or scaling coefficients
+    and the short and long base shocks they scale, as the IRRBB steepener
+    (-0.65 short, +0.9 long) and flattener (+0.8 short, -0.6 long) do.
+*/
+struct StressScenario {
+    enum class Type { PARALLEL, TWIST, FX };
+
+    std::string name;
+    Type type;
+    double short_bp{0.0}, long_bp{0.0}, fx_move{0.0};
+
+    // e.g. "TWIST_BP TWIST -195 135" or, as coefficients of base shocks of
+    // 300bp (short) and 150bp (long), "STEEPENER TWIST -0.65 0.9 300 150"
+    static std::optional<StressScenario> parse(const std::string& line) {
+        std::istringstream s_line{line};
+        StressScenario stress;
+        std::string type;
+        if (!(s_line >> stress.name >> type)) return {};
+        if (type == "PARALLEL" && s_line >> stress.short_bp) {
+            stress.type = Type::PARALLEL;
+            stress.long_bp = stress.short_bp;
+        } else if (type == "TWIST" &&
+                   s_line >> stress.short_bp >> stress.long_bp) {
+            stress.type = Type::TWIST;
+            double short_base, long_base;
+            if (s_line >> short_base) {
+                if (!(s_line >> long_base)) return {};
+                stress.short_bp *= short_base;
+                stress.long_bp *= long_base;
+            }
+        } else if (type == "FX" && s_line >> stress.fx_move) {
+            stress.type = Type::FX;
+        } else {
+            return {};
+        }
+        return stress;
+    }
+
+    // Absolute shift to the rate at tenor (in days)
+    double get_rate_shift(int tenor) const {
+        switch (type) {
+            case Type::PARALLEL:
+                return short_bp * 1e-4;
+            case Type::TWIST: {
+                double decay{std::exp(-tenor / (4 * 360.0))};
+                return (short_bp * decay + long_bp * (1 - decay)) * 1e-4;
+            }
+            default:
+                return 0.0;
+        }
+    }
+
+    // Relative move of the XXXUSD spots
+    double get_fx_shift() const { return type == Type::FX ? fx_move : 0.0; }
+};
+
+/* A symmetric n x n matrix that stores only its lower triangle, row by row */
+struct SymmetricMatrix {
+    explicit SymmetricMatrix(size_t n = 0) : n{n}, data(n * (n + 1) / 2, 0.0) {}
+
+    double& operator()(size_t i, size_t j) {
+        if (i < j) std::swap(i, j);
+        return data[i * (i + 1) / 2 + j];
+    }
+    double operator()(size_t i, size_t j) const {
+        if (i < j) std::swap(i, j);
+        return data[i * (i + 1) / 2 + j];
+    }
+
+    SymmetricMatrix& operator+=(const SymmetricMatrix& other) {
+        for (size_t k = 0; k < data.size(); ++k) data[k] += other.data[k];
+        return *this;
+    }
+    SymmetricMatrix& operator*=(double factor) {
+        for (double& x : data) x *= factor;
+        return *this;
+    }
+
+    size_t size() const { return n; }
+
+   private:
+    size_t n;
+    std::vector<double> data;
+};
+
+/*
+    The lower-triangular Cholesky factor L of a covariance matrix C = L L^T,
+    so that x = L z has covariance C for independent standard normals z.
+    Pivots that are not positive (a semi-definite C, e.g. estimated from
+    fewer observations than factors) zero their column instead of failing.
+*/
+struct CholeskyFactor {
+    explicit CholeskyFactor(const SymmetricMatrix& c)
+        : n{c.size()}, data(n * (n + 1) / 2, 0.0) {
+        for (size_t j = 0; j < n; ++j) {
+            double pivot{c(j, j)};
+            for (size_t k = 0; k < j; ++k) pivot -= at(j, k) * at(j, k);
+            if (pivot <= 0.0) continue;
+            double l_jj{std::sqrt(pivot)};
+            at(j, j) = l_jj;
+            for (size_t i = j + 1; i < n; ++i) {
+                double sum{c(i, j)};
+                for (size_t k = 0; k < j; ++k) sum -= at(i, k) * at(j, k);
+                at(i, j) = sum / l_jj;
+            }
+        }
+    }
+
+    // x = L z for vectors of length size(); rows are contiguous in memory
+    void multiply(const double* z, double* x) const {
+        const double* row{data.data()};
+        for (size_t i = 0; i < n; ++i) {
+            double sum{0.0};
+            for (size_t k = 0; k <= i; ++k) sum += row[k] * z[k];
+            x[i] = sum;
+            row += i + 1;
+        }
+    }
+
+    size_t size() const { return n; }
+
+   private:
+    double& at(size_t i, size_t j) { return data[i * (i + 1) / 2 + j]; }
+
+    size_t n;
+    std::vector<double> data;
+};
+
+/*
+    Delta-normal variance s' C s of a P&L with sensitivities s to factors with
+    covariance C. C is expanded to a dense row-major matrix and C s is found
+    tile by tile so that each tile of C and the matching pieces of s and C s
+    stay in cache together. C s is kept, so that changing a block of s (e.g.
+    one currency's sensitivities) costs O(n x block) instead of O(n^2):
+        C s' = C s + C[:, block] d
+        s' C s' = s' C s + d' ((C s)[block] + (C s')[block])
+    where d is the change in the block.
+*/
+class DeltaNormalVaR {
+   public:
+    explicit DeltaNormalVaR(const SymmetricMatrix& c)
+        : n{c.size()}, covariance(n * n), s(n, 0.0), cs(n, 0.0) {
+        for (size_t i = 0; i < n; ++i) {
+            for (size_t j = 0; j < n; ++j) covariance[i * n + j] = c(i, j);
+        }
+    }
+
+    // Replace s[begin, begin + block.size()) and update C s and s' C s
+    void set_sensitivities(size_t begin, const std::vector<double>& block) {
+        size_t end{begin + block.size()};
+        std::vector<double> d(block.size()), old_cs(cs.begin() + begin,
+                                                    cs.begin() + end);
+        for (size_t k = 0; k < block.size(); ++k) {
+            d[k] = block[k] - s[begin + k];
+        }
+        multiply_add(0, n, begin, end, d.data(), cs.data());
+        for (size_t k = 0; k < block.size(); ++k) {
+            variance += d[k] * (old_cs[k] + cs[begin + k]);
+            s[begin + k] = block[k];
+        }
+    }
+
+    double get_variance() const { return variance; }
+
+    // s[begin, end)' (C s)[begin, end), which add up to the variance
+    double get_contribution(size_t begin, size_t end) const {
+        double total{0.0};
+        for (size_t k = begin; k < end; ++k) total += s[k] * cs[k];
+        return total;
+    }
+
+   private:
+    static constexpr size_t TILE{64};  // 64 x 64 doubles = 32KB
+
+    // y[rows] += C[rows, cols] x where x is indexed from col_begin
+    void multiply_add(size_t row_begin, size_t row_end, size_t col_begin,
+                      size_t col_end, const double* x, double* y) const {
+        for (size_t ii = row_begin; ii < row_end; ii += TILE) {
+            for (size_t jj = col_begin; jj < col_end; jj += TILE) {
+                size_t i_end{std::min(ii + TILE, row_end)};
+                size_t j_end{std::min(jj + TILE, col_end)};
+                for (size_t i = ii; i < i_end; ++i) {
+                    const double* row{covariance.data() + i * n};
+                    double sum{0.0};
+                    for (size_t j = jj; j < j_end; ++j) {
+                        sum += row[j] * x[j - col_begin];
+                    }
+                    y[i] += sum;
+                }
+            }
+        }
+    }
+
+    size_t n;
+    std::vector<double> covariance;
+    std::vector<double> s, cs;
+    double variance{0.0};
+};
+
+// Inverse of the standard normal CDF (Acklam's rational approximation with
+// one Newton step, accurate to about 1e-15), for 0 < p < 1
+inline double inverse_normal_cdf(double p) {
+    static constexpr double a[]{-3.969683028665376e+01, 2.209460984245205e+02,
+                                -2.759285104469687e+02, 1.383577518672690e+02,
+                                -3.066479806614716e+01, 2.506628277459239e+00};
+    static constexpr double b[]{-5.447609879822406e+01, 1.615858368580409e+02,
+                                -1.556989798598866e+02, 6.680131188771972e+01,
+                                -1.328068155288572e+01};
+    static constexpr double c[]{-7.784894002430293e-03, -3.223964580411365e-01,
+                                -2.400758277161838e+00, -2.549732539343734e+00,
+                                4.374664141464968e+00,  2.938163982698783e+00};
+    static constexpr double d[]{7.784695709041462e-03, 3.224671290700398e-01,
+                                2.445134137142996e+00, 3.754408661907416e+00};
+    double x;
+    if (p < 0.02425) {
+        double q{std::sqrt(-2 * std::log(p))};
+        x = (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q +
+             c[5]) /
+            ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+    } else if (p > 1 - 0.02425) {
+        double q{std::sqrt(-2 * std::log(1 - p))};
+        x = -(((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q +
+              c[5]) /
+            ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+    } else {
+        double q{p - 0.5}, r{q * q};
+        x = (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r +
+             a[5]) *
+            q /
+            (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1);
+    }
+    // refine with Newton's method on erfc
+    double e{0.5 * std::erfc(-x / std::sqrt(2.0)) - p};
+    return x - e * std::sqrt(2 * std::numbers::pi) * std::exp(x * x / 2);
+}
+
+/*
+    Counter-based random numbers: the n-th draw of a stream is a hash of
+    (seed, stream, n) rather than the n-th state of a sequential generator, so
+    any block of draws can be produced on any thread in any order and results
+    are reproducible whatever the number of threads. The hash is the SplitMix64
+    finaliser and normals come from the Box-Muller transform.
+*/
+struct CounterRNG {
+    CounterRNG(uint64_t seed, uint64_t stream)
+        : key{mix(mix(seed) ^ (stream * 0xD1B54A32D192ED03ull))} {}
+
+    // Uniform in (0, 1)
+    double uniform(uint64_t counter) const {
+        return ((mix(key ^ mix(counter)) >> 11) + 0.5) * 0x1.0p-53;
+    }
+
+    // Standard normal, using the uniforms at counters 2n and 2n + 1
+    double normal(uint64_t counter) const {
+        double u1{uniform(2 * counter)}, u2{uniform(2 * counter + 1)};
+        return std::sqrt(-2.0 * std::log(u1)) *
+               std::cos(6.283185307179586 * u2);
+    }
+
+   private:
+    static uint64_t mix(uint64_t x) {
+        x += 0x9E3779B97F4A7C15ull;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        return x ^ (x >> 31);
+    }
+
+    uint64_t key;
+};
+
+/*
+    Cash flows of a book summed into date buckets of a fixed width in days
+    (bucket b covers [b * width, (b + 1) * width)), as dense columns
+*/
+struct CashLadder {
+    int width;
+    std::vector<int> starts;  // first day of each bucket
+    std::vector<double> undiscounted, discounted;
+};
+
+/*
+    The cashflows of one book laid out against the nodes of one curve, in
+    structure-of-arrays form. Cashflows are sorted by effective date so the
+    interpolation weights of all of them are found in a single merge-like sweep
+    over the curve nodes, after which risk calculations are flat array loops
+    with no map lookups or logging.
+*/
+struct CashflowGrid {
+    using NodeWeights = InterestRates::NodeWeights;
+
+    CashflowGrid(const InterestRates& curve, const DateNotionals& book)
+        : CashflowGrid(curve, book.get_cashflows()) {}
+
+    CashflowGrid(const InterestRates& curve,
+                 const std::vector<std::pair<int, int>>& cashflows) {
+        auto k = curve.get_tenors();
+        tenors.assign(k.begin(), k.end());
+        rates = curve.get_rates();
+        times.reserve(cashflows.size());
+        notionals.reserve(cashflows.size());
+        weights.reserve(cashflows.size());
+
+        // i is the index of the first node with tenor > t (cf. upper_bound)
+        size_t i = 0;
+        for (auto& [t, notional] : cashflows) {
+            while (i < tenors.size() && tenors[i] <= t) ++i;
+            times.push_back(t);
+            notionals.push_back(notional);
+            weights.push_back(get_weights(t, i));
+        }
+    }
+
+    size_t size() const { return times.size(); }
+
+    // Add notional to the cashflow at t, inserted in time order if there is
+    // none yet, as a fresh build from the updated book would lay it out.
+    // RETURNS its index
+    size_t add_cashflow(int t, int notional) {
+        size_t j = std::ranges::lower_bound(times, t) - times.begin();
+        if (j < size() && times[j] == t) {
+            notionals[j] += notional;
+            return j;
+        }
+        size_t i = std::ranges::upper_bound(tenors, t) - tenors.begin();
+        times.insert(times.begin() + j, t);
+        notionals.insert(notionals.begin() + j, notional);
+        weights.insert(weights.begin() + j, get_weights(t, i));
+        return j;
+    }
+
+    // Node weights of times[j] - days (paid today if it would be in the past)
+    // from the segment of times[j]: rolling the valuation date forward only
+    // moves a cashflow back across the nodes between the two times.
+    // REQUIRES days >= 0
+    NodeWeights get_rolled_weights(size_t j, int days) const {
+        int t{std::max(times[j] - days, 0)};
+        const NodeWeights& nw = weights[j];
+        size_t i = nw.right >= 0 ? nw.right : tenors.size();
+        while (i > 0 && tenors[i - 1] > t) --i;
+        return get_weights(t, i);
+    }
+
+    // Book PV in the local currency with the valuation date rolled forward by
+    // days and the curve unchanged as a function of tenor. REQUIRES days >= 0
+    double get_rolled_book_value(int days) const {
+        double total{0.0};
+        for (size_t j = 0; j < size(); ++j) {
+            const NodeWeights& nw = get_rolled_weights(j, days);
+            double r{0.0};
+            if (nw.left >= 0) r += nw.w_left * rates[nw.left];
+            if (nw.right >= 0) r += nw.w_right * rates[nw.right];
+            double t{static_cast<double>(std::max(times[j] - days, 0))};
+            total += notionals[j] * std::exp(-r * (t / 360.0));
+        }
+        return total;
+    }
+
+    // Interpolated rate at times[j] given (possibly shifted) node rates. The
+    // valuation is written once for any Real: double, or an AAD Number that
+    // records itself on a Tape (see aad.h)
+    template <typename Real>
+    Real get_rate(size_t j, const std::vector<Real>& node_rates) const {
+        const NodeWeights& nw = weights[j];
+        Real r{0.0};
+        if (nw.left >= 0) r += nw.w_left * node_rates[nw.left];
+        if (nw.right >= 0) r += nw.w_right * node_rates[nw.right];
+        return r;
+    }
+
+    template <typename Real>
+    Real get_discount_factor(size_t j,
+                             const std::vector<Real>& node_rates) const {
+        using std::exp;  // or exp(Number) by ADL
+        return exp(-get_rate(j, node_rates) * (times[j] / 360.0));
+    }
+
+    // Book PVs in the local currency for K parallel shifts of every node at
+    // once. A shift h moves r_t by (w_left + w_right) * h (less than h before
+    // the first node, where the origin stays put), so each cashflow adds
+    // n * DF * exp(-(w_left + w_right) * h * t / 360) to K accumulators held
+    // in a fixed-size array: one pass over the cashflows for all shifts.
+    template <size_t K>
+    std::array<double, K> get_shifted_book_values(
+        const std::array<double, K>& shifts) const {
+        std::array<double, K> totals{};
+        for (size_t j = 0; j < size(); ++j) {
+            const NodeWeights& nw = weights[j];
+            double npv{notionals[j] * get_discount_factor(j, rates)};
+            double a{-(nw.w_left + nw.w_right) * (times[j] / 360.0)};
+            for (size_t k = 0; k < K; ++k) {
+                totals[k] += npv * std::exp(a * shifts[k]);
+            }
+        }
+        return totals;
+    }
+
+    // Expected book PV in the local currency at each horizon (ascending, in
+    // days) under today's curve: cashflows paid by the horizon are dropped
+    // and the rest discounted to it with forward DFs, i.e.
+    // sum_{t > h} n * DF(t) / DF(h). Suffix sums of n * DF(t) over the sorted
+    // cashflows give every horizon in O(cashflows + horizons).
+    std::vector<double> get_forward_book_values(
+        const std::vector<int>& horizons) const {
+        std::vector<double> suffix(size() + 1, 0.0);
+        for (size_t j = size(); j-- > 0;) {
+            suffix[j] =
+                suffix[j + 1] + notionals[j] * get_discount_factor(j, rates);
+        }
+        std::vector<double> values;
+        values.reserve(horizons.size());
+        size_t j = 0, i = 0;  // first cashflow after h, first node after h
+        for (int h : horizons) {
+            while (j < size() && times[j] <= h) ++j;
+            while (i < tenors.size() && tenors[i] <= h) ++i;
+            NodeWeights nw{get_weights(h, i)};
+            double r{0.0};
+            if (nw.left >= 0) r += nw.w_left * rates[nw.left];
+            if (nw.right >= 0) r += nw.w_right * rates[nw.right];
+            values.push_back(suffix[j] * std::exp(r * (h / 360.0)));
+        }
+        return values;
+    }
+
+    // Cash ladders in the local currency for K bucket widths, from one scan
+    // over the cashflows: each discount factor is found once and added to
+    // its bucket of every width. Ladders run to the bucket of the last
+    // cashflow, with empty buckets in between, and have no buckets at all
+    // without cashflows.
+    template <size_t K>
+    std::array<CashLadder, K> get_cash_ladders(
+        const std::array<int, K>& widths) const {
+        std::array<CashLadder, K> ladders;
+        for (size_t k = 0; k < K; ++k) {
+            size_t n{times.empty()
+                         ? 0
+                         : static_cast<size_t>(times.back() / widths[k] + 1)};
+            ladders[k].width = widths[k];
+            ladders[k].starts.resize(n);
+            for (size_t b = 0; b < n; ++b) {
+                ladders[k].starts[b] = static_cast<int>(b) * widths[k];
+            }
+            ladders[k].undiscounted.assign(n, 0.0);
+            ladders[k].discounted.assign(n, 0.0);
+        }
+        for (size_t j = 0; j < size(); ++j) {
+            double pv{notionals[j] * get_discount_factor(j, rates)};
+            for (size_t k = 0; k < K; ++k) {
+                size_t b{static_cast<size_t>(times[j] / widths[k])};
+                ladders[k].undiscounted[b] += notionals[j];
+                ladders[k].discounted[b] += pv;
+            }
+        }
+        return ladders;
+    }
+
+    // Cross-gamma d2PV / dr_i dr_k of the cashflows [begin, end) in the local
+    // currency. r_t is linear in the node rates, so the second derivative of
+    // exp(-r_t * t / 360) is w_i * w_k * (t / 360)^2 * exp(-r_t * t / 360),
+    // which is only non-zero for the (at most two) nodes around each t
+    SymmetricMatrix get_gamma(size_t begin, size_t end) const {
+        SymmetricMatrix gamma{tenors.size()};
+        for (size_t j = begin; j < end; ++j) {
+            const NodeWeights& nw = weights[j];
+            double t{times[j] / 360.0};
+            double c{notionals[j] * get_discount_factor(j, rates) * t * t};
+            if (nw.left >= 0) {
+                gamma(nw.left, nw.left) += c * nw.w_left * nw.w_left;
+            }
+            if (nw.right >= 0) {
+                gamma(nw.right, nw.right) += c * nw.w_right * nw.w_right;
+            }
+            if (nw.left >= 0 && nw.right >= 0) {
+                gamma(nw.left, nw.right) += c * nw.w_left * nw.w_right;
+            }
+        }
+        return gamma;
+    }
+
+    // Book PV in the local currency, the successor of
+    // DateNotionals::get_book_value without logging or map lookups
+    template <typename Real>
+    Real get_book_value(const std::vector<Real>& node_rates) const {
+        Real total{0.0};
+        for (size_t j = 0; j < size(); ++j) {
+            total += notionals[j] * get_discount_factor(j, node_rates);
+        }
+        return total;
+    }
+
+    std::vector<int> tenors;  // curve nodes, ascending
+    std::vector<double> rates;
+    std::vector<int> times;  // effective dates, ascending
+    std::vector<double> notionals;
+    std::vector<NodeWeights> weights;
+
+   private:
+    // Weights of the nodes around t, where i is the index of the first node
+    // with tenor > t
+    NodeWeights get_weights(int t, size_t i) const {
+        NodeWeights nw;
+        if (i == 0) {
+            // between the origin and the first node
+            nw.right = 0;
+            nw.w_right = static_cast<double>(t) / tenors[0];
+        } else if (i == tenors.size()) {
+            // constant yield beyond last data point
+            nw.left = static_cast<int>(i - 1);
+            nw.w_left = 1.0;
+        } else {
+            int t_left{tenors[i - 1]}, t_right{tenors[i]};
+            nw.left = static_cast<int>(i - 1);
+            nw.right = static_cast<int>(i);
+            nw.w_left = static_cast<double>(t_right - t) / (t_right - t_left);
+            nw.w_right = static_cast<double>(t - t_left) / (t_right - t_left);
+        }
+        return nw;
+    }
+};
+
+/*
+    PV and analytic DV01 ladder of a book in its local currency, kept up to
+    date as the curve nodes tick. The cashflows are sorted by time, so those
+    whose rate is interpolated from node k are the two contiguous segments
+    (k - 1, k) and (k, k + 1). Each segment keeps its PV and its DV01s to its
+    two nodes: a tick revalues only the segments of its node, a new trade
+    only the segment of its cashflow, and totals are sums over the (few)
+    segments, in the same order as a fresh build.
+*/
+struct IncrementalBook {
+    // DV01s are -dPV/dr scaled to a bump of eps
+    IncrementalBook(CashflowGrid cashflows, double eps)
+        : grid{std::move(cashflows)}, eps{eps} {
+        // segment s lies between nodes s - 1 and s (s = 0 from the origin,
+        // s = n beyond the last node)
+        size_t n{grid.tenors.size()};
+        segment_begin.assign(n + 2, grid.size());
+        for (size_t j = grid.size(); j-- > 0;) {
+            segment_begin[get_segment(j)] = j;
+        }
+        for (size_t s = n + 1; s-- > 0;) {
+            segment_begin[s] = std::min(segment_begin[s], segment_begin[s + 1]);
+        }
+        segment_pvs.assign(n + 1, 0.0);
+        left_dv01s.assign(n + 1, 0.0);
+        right_dv01s.assign(n + 1, 0.0);
+        for (size_t s = 0; s <= n; ++s) revalue(s);
+    }
+
+    // RETURNS the number of cashflows revalued
+    size_t set_rate(size_t node, double rate) {
+        grid.rates[node] = rate;
+        revalue(node);
+        revalue(node + 1);
+        return segment_begin[node + 2] - segment_begin[node];
+    }
+
+    // A new trade only revalues the segment of its cashflow. RETURNS the
+    // number of cashflows revalued
+    size_t add_cashflow(int t, int notional) {
+        size_t n_before{grid.size()};
+        size_t s{get_segment(grid.add_cashflow(t, notional))};
+        if (grid.size() > n_before) {
+            // the later segments start one cashflow further on
+            for (size_t k = s + 1; k < segment_begin.size(); ++k) {
+                ++segment_begin[k];
+            }
+        }
+        revalue(s);
+        return segment_begin[s + 1] - segment_begin[s];
+    }
+
+    double get_book_value() const {
+        return std::reduce(segment_pvs.begin(), segment_pvs.end());
+    }
+
+    // In the order of the curve nodes
+    std::vector<double> get_ladder() const {
+        std::vector<double> ladder(grid.tenors.size());
+        for (size_t i = 0; i < ladder.size(); ++i) {
+            ladder[i] = right_dv01s[i] + left_dv01s[i + 1];
+        }
+        return ladder;
+    }
+
+    // The PV then the ladder into out[0], ..., out[n], without allocating
+    void get_risk(double* out) const {
+        out[0] = get_book_value();
+        for (size_t i = 0; i < grid.tenors.size(); ++i) {
+            out[i + 1] = right_dv01s[i] + left_dv01s[i + 1];
+        }
+    }
+
+    const CashflowGrid& get_grid() const { return grid; }
+
+   private:
+    size_t get_segment(size_t j) const {
+        const auto& nw = grid.weights[j];
+        if (nw.left < 0) return 0;
+        if (nw.right < 0) return grid.tenors.size();
+        return static_cast<size_t>(nw.left) + 1;
+    }
+
+    void revalue(size_t segment) {
+        double pv{0.0}, left{0.0}, right{0.0};
+        for (size_t j = segment_begin[segment]; j < segment_begin[segment + 1];
+             ++j) {
+            const auto& nw = grid.weights[j];
+            double r{grid.get_rate(j, grid.rates)};
+            double t{static_cast<double>(grid.times[j])};
+            double npv{grid.notionals[j] *
+                       grid.get_discount_factor(j, grid.rates)};
+            double dv01{grid.notionals[j] * t / 360 * std::exp(-r * t / 360) *
+                        eps};
+            pv += npv;
+            left += nw.w_left * dv01;
+            right += nw.w_right * dv01;
+        }
+        segment_pvs[segment] = pv;
+        left_dv01s[segment] = left;
+        right_dv01s[segment] = right;
+    }
+
+    CashflowGrid grid;
+    double eps;
+    std::vector<size_t> segment_begin;  // n + 2 offsets into the cashflows
+    std::vector<double> segment_pvs, left_dv01s, right_dv01s;
+};
+
+/*
+    Limits on the absolute values of a dense vector of risk numbers (no limit
+    is +infinity). A check compares every value in one branch-free pass and
+    only looks for the breaches when there is one, so the common case of no
+    breach is a single tight loop and neither path allocates.
+*/
+class LimitBook {
+   public:
+    explicit LimitBook(size_t n = 0)
+        : limits(n, std::numeric_limits<double>::infinity()), breached(n, 0) {}
+
+    void set_limit(size_t i, double limit) { limits[i] = limit; }
+    double get_limit(size_t i) const { return limits[i]; }
+    size_t size() const { return limits.size(); }
+
+    // Calls on_breach(i, values[i], limit) for every |values[i]| > limit.
+    // RETURNS the number of breaches
+    template <typename F>
+    size_t check(const double* values, F&& on_breach) {
+        size_t n_breaches{0};
+        for (size_t i = 0; i < limits.size(); ++i) {
+            breached[i] = std::abs(values[i]) > limits[i];
+            n_breaches += breached[i];
+        }
+        if (n_breaches == 0) return 0;
+        for (size_t i = 0; i < limits.size(); ++i) {
+            if (breached[i]) on_breach(i, values[i], limits[i]);
+        }
+        return n_breaches;
+    }
+
+   private:
+    std::vector<double> limits;
+    std::vector<unsigned char> breached;  // not vector<bool>: no bit packing
+};
+
+/*
+    A standard grid of key-rate buckets, by default the SIMM interest rate
+    tenors (2W to 30Y), so that ladders of curves with different nodes line
+    up. The DV01 to a node is split between the two buckets around its
+    tenor, linearly in tenor, and a node outside the grid goes to the
+    nearest bucket, so bucketing keeps the total DV01.
+*/
+struct KeyRateBuckets {
+    std::vector<int> tenors{14,   30,   90,   180,  360,  720,
+                            1080, 1800, 3600, 5400, 7200, 10800};
+
+    // Allocation of each node (ascending) over the buckets, as the weights
+    // of its left and right bucket
+    std::vector<InterestRates::NodeWeights> get_allocation(
+        const std::vector<int>& nodes) const {
+        std::vector<InterestRates::NodeWeights> allocation;
+        allocation.reserve(nodes.size());
+        size_t b = 0;  // the first bucket with tenor > node
+        for (int node : nodes) {
+            while (b < tenors.size() && tenors[b] <= node) ++b;
+            InterestRates::NodeWeights nw;
+            if (b == 0) {
+                nw.right = 0;
+                nw.w_right = 1.0;
+            } else if (b == tenors.size() || tenors[b - 1] == node) {
+                nw.left = static_cast<int>(b - 1);
+                nw.w_left = 1.0;
+            } else {
+                int t_left{tenors[b - 1]}, t_right{tenors[b]};
+                nw.left = static_cast<int>(b - 1);
+                nw.right = static_cast<int>(b);
+                double width{static_cast<double>(t_right - t_left)};
+                nw.w_left = (t_right - node) / width;
+                nw.w_right = (node - t_left) / width;
+            }
+            allocation.push_back(nw);
+        }
+        return allocation;
+    }
+};
+
+/*
+    Par rates of the hedging instruments at the nodes of a zero curve and
+    their Jacobian dp_i / dz_k w.r.t. the zero rates: a deposit up to 1Y
+    (p = (1 / DF(T) - 1) * 360 / T) and an annual fixed leg beyond
+    (p = (1 - DF(T)) / sum_k a_k DF(t_k), paying back from T with a short
+    first period). Every DF is interpolated as in CashflowGrid, so
+    dDF(t) / dz_k = -w_k * t / 360 * DF(t). Sensitivities to the par quotes
+    are s_p = s_z' J^-1, one matrix product once the inverse is cached.
+*/
+struct ParJacobian {
+    explicit ParJacobian(const InterestRates& curve) {
+        auto k = curve.get_tenors();
+        tenors.assign(k.begin(), k.end());
+        size_t n{tenors.size()};
+
+        // Payment times of every instrument, each with its accrual
+        std::vector<std::vector<std::pair<int, double>>> legs(n);
+        std::vector<std::pair<int, int>> payments;
+        for (size_t i = 0; i < n; ++i) {
+            for (int t = tenors[i]; t > 0; t -= YEAR) {
+                legs[i].emplace_back(t, (t - std::max(t - YEAR, 0)) / 360.0);
+                payments.emplace_back(t, 1);
+                if (tenors[i] <= YEAR) break;  // a deposit pays once
+            }
+        }
+        std::ranges::sort(payments);
+        auto [first, last] = std::ranges::unique(payments);
+        payments.erase(first, last);
+        CashflowGrid grid{curve, payments};
+        auto at = [&grid](int t) {
+            return static_cast<size_t>(
+                std::ranges::lower_bound(grid.times, t) - grid.times.begin());
+        };
+        // dDF(t) / dz_k for the payment at grid index j, added into row
+        auto add_derivative = [&grid](size_t j, double scale,
+                                         std::vector<double>& row) {
+            const auto& nw = grid.weights[j];
+            double d{-scale * grid.times[j] / 360.0 *
+                     grid.get_discount_factor(j, grid.rates)};
+            if (nw.left >= 0) row[nw.left] += nw.w_left * d;
+            if (nw.right >= 0) row[nw.right] += nw.w_right * d;
+        };
+
+        jacobian.assign(n * n, 0.0);
+        for (size_t i = 0; i < n; ++i) {
+            std::vector<double> row(n, 0.0);
+            if (tenors[i] == 0) {
+                // no instrument: the par rate is the zero rate
+                par_rates.push_back(grid.rates[i]);
+                row[i] = 1.0;
+            } else if (tenors[i] <= YEAR) {
+                size_t j{at(tenors[i])};
+                double df{grid.get_discount_factor(j, grid.rates)};
+                double scale{360.0 / tenors[i]};
+                par_rates.push_back((1 / df - 1) * scale);
+                add_derivative(j, -scale / (df * df), row);
+            } else {
+                double annuity{0.0};
+                for (auto [t, accrual] : legs[i]) {
+                    annuity +=
+                        accrual * grid.get_discount_factor(at(t), grid.rates);
+                }
+                size_t j{at(tenors[i])};
+                double p{(1 - grid.get_discount_factor(j, grid.rates)) /
+                         annuity};
+                par_rates.push_back(p);
+                add_derivative(j, -1 / annuity, row);
+                for (auto [t, accrual] : legs[i]) {
+                    add_derivative(at(t), -p * accrual / annuity, row);
+                }
+            }
+            std::ranges::copy(row, jacobian.begin() + i * n);
+        }
+        inverse = invert(jacobian, n);
+    }
+
+    // Par DV01s from zero DV01s, both in node order
+    std::vector<double> to_par(const std::vector<double>& zero_ladder) const {
+        size_t n{tenors.size()};
+        std::vector<double> par_ladder(n, 0.0);
+        for (size_t k = 0; k < n; ++k) {
+            for (size_t i = 0; i < n; ++i) {
+                par_ladder[i] += zero_ladder[k] * inverse[k * n + i];
+            }
+        }
+        return par_ladder;
+    }
+
+    std::vector<int> tenors;  // curve nodes, ascending
+    std::vector<double> par_rates;
+    std::vector<double> jacobian;  // row-major dp_i / dz_k
+    std::vector<double> inverse;   // row-major dz_k / dp_i
+
+   private:
+    static constexpr int YEAR{360};
+
+    // Gauss-Jordan elimination with partial pivoting of a row-major n x n
+    // matrix (J is lower triangular here, so no pivot is ever zero)
+    static std::vector<double> invert(std::vector<double> a, size_t n) {
+        std::vector<double> inv(n * n, 0.0);
+        for (size_t i = 0; i < n; ++i) inv[i * n + i] = 1.0;
+        for (size_t c = 0; c < n; ++c) {
+            size_t pivot{c};
+            for (size_t r = c + 1; r < n; ++r) {
+                if (std::abs(a[r * n + c]) > std::abs(a[pivot * n + c])) {
+                    pivot = r;
+                }
+            }
+            for (size_t k = 0; k < n; ++k) {
+                std::swap(a[c * n + k], a[pivot * n + k]);
+                std::swap(inv[c * n + k], inv[pivot * n + k]);
+            }
+            double d{a[c * n + c]};
+            for (size_t k = 0; k < n; ++k) {
+                a[c * n + k] /= d;
+                inv[c * n + k] /= d;
+            }
+            for (size_t r = 0; r < n; ++r) {
+                double f{a[r * n + c]};
+                if (r == c || f == 0.0) continue;
+                for (size_t k = 0; k < n; ++k) {
+                    a[r * n + k] -= f * a[c * n + k];
+                    inv[r * n + k] -= f * inv[c * n + k];
+                }
+            }
+        }
+        return inv;
+    }
+};
@@ -0,0 +1,202 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <numbers>
+#include <numeric>
+#include <vector>
+
+/*
+    Tail statistics of a stream of losses (positive numbers are losses) for
+    scenario engines that cannot store and sort every P&L. Both estimators
+    are mergeable, so each thread can summarise its own scenarios and the
+    partial results are combined after a parallel run:
+    - ExactTail keeps the k largest losses (with a payload, e.g. the P&L of
+      each book) in a bounded min-heap: exact VaR and ES at one confidence
+      level, in O(k) memory;
+    - TDigest is a merging t-digest (Dunning, 2019) whose centroids are small
+      in the tails and large in the body: VaR and ES at any confidence level
+      in memory that does not depend on the number of losses.
+*/
+
+/* The k largest losses of a stream, each with a payload */
+struct ExactTail {
+    struct Scenario {
+        double loss;
+        std::vector<double> payload;
+        bool operator>(const Scenario& other) const {
+            return loss > other.loss;
+        }
+    };
+
+    explicit ExactTail(size_t k) : k{k} {}
+
+    // Keeps the scenario if it is among the k largest losses so far
+    void push(double loss, const std::vector<double>& payload) {
+        if (heap.size() == k && loss <= heap.front().loss) return;
+        push({loss, payload});
+    }
+    void push(Scenario scenario) {
+        if (heap.size() == k) {
+            if (scenario.loss <= heap.front().loss) return;
+            std::ranges::pop_heap(heap, std::greater<>{});
+            heap.pop_back();
+        }
+        heap.push_back(std::move(scenario));
+        std::ranges::push_heap(heap, std::greater<>{});
+    }
+    void merge(ExactTail other) {
+        for (auto& scenario : other.heap) push(std::move(scenario));
+    }
+
+    // Worst loss first
+    std::vector<Scenario> get_sorted() const {
+        auto sorted = heap;
+        std::ranges::sort(sorted, std::greater<>{});
+        return sorted;
+    }
+
+   private:
+    size_t k;
+    std::vector<Scenario> heap;
+};
+
+/* Approximate distribution of a stream of values in bounded memory */
+class TDigest {
+   public:
+    // Higher compression means more centroids and more accurate quantiles
+    explicit TDigest(double compression = 200)
+        : compression{compression},
+          buffer_limit{BUFFER_FACTOR * static_cast<size_t>(compression)} {
+        buffer.reserve(buffer_limit);
+    }
+
+    void add(double x, double weight = 1.0) {
+        buffer.push_back({x, weight});
+        min = std::min(min, x);
+        max = std::max(max, x);
+        if (buffer.size() >= buffer_limit) compress();
+    }
+
+    void merge(const TDigest& other) {
+        for (auto& c : other.centroids) buffer.push_back(c);
+        for (auto& c : other.buffer) buffer.push_back(c);
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+        compress();
+    }
+
+    double get_count() const {
+        double count{0.0};
+        for (auto& c : centroids) count += c.weight;
+        for (auto& c : buffer) count += c.weight;
+        return count;
+    }
+
+    // Value below which a fraction q of the weight lies, interpolating
+    // between centroid means (and min / max at the ends)
+    double quantile(double q) {
+        compress();
+        if (centroids.empty()) return std::numeric_limits<double>::quiet_NaN();
+        if (centroids.size() == 1) return centroids.front().mean;
+        double index{q * total};
+        const auto& first = centroids.front();
+        if (index < first.weight / 2) {
+            return min + index / (first.weight / 2) * (first.mean - min);
+        }
+        double so_far{first.weight / 2};
+        for (size_t i = 0; i + 1 < centroids.size(); ++i) {
+            double step{(centroids[i].weight + centroids[i + 1].weight) / 2};
+            if (so_far + step > index) {
+                double z{(index - so_far) / step};
+                return centroids[i].mean +
+                       z * (centroids[i + 1].mean - centroids[i].mean);
+            }
+            so_far += step;
+        }
+        const auto& last = centroids.back();
+        double z{std::min((index - so_far) / (last.weight / 2), 1.0)};
+        return last.mean + z * (max - last.mean);
+    }
+
+    // Mean of the values above the q-quantile, taking centroids from the top
+    // and the needed fraction of the one that straddles the quantile
+    double tail_mean(double q) {
+        compress();
+        if (centroids.empty()) return std::numeric_limits<double>::quiet_NaN();
+        double tail{(1 - q) * total}, weight{0.0}, sum{0.0};
+        for (auto it = centroids.rbegin(); it != centroids.rend(); ++it) {
+            double take{std::min(it->weight, tail - weight)};
+            sum += take * it->mean;
+            weight += take;
+            if (weight >= tail) break;
+        }
+        return weight > 0 ? sum / weight : centroids.back().mean;
+    }
+
+   private:
+    struct Centroid {
+        double mean, weight;
+    };
+    static constexpr size_t BUFFER_FACTOR{5};
+
+    // Scale function k1: centroids may span at most 1 in k, so they are
+    // small near q = 0 and q = 1
+    double k_scale(double q) const {
+        return compression / (2 * std::numbers::pi) * std::asin(2 * q - 1);
+    }
+
+    // Sorts the buffered values into the centroids and merges neighbours
+    // while the merged centroid stays within the size limit
+    void compress() {
+        if (buffer.empty()) return;
+        buffer.insert(buffer.end(), centroids.begin(), centroids.end());
+        std::ranges::sort(buffer, {}, &Centroid::mean);
+        total = 0.0;
+        for (auto& c : buffer) total += c.weight;
+
+        centroids.clear();
+        Centroid current{buffer.front()};
+        double so_far{0.0};  // weight before current
+        double k_left{k_scale(0.0)};
+        for (size_t i = 1; i < buffer.size(); ++i) {
+            const auto& next = buffer[i];
+            double q_right{(so_far + current.weight + next.weight) / total};
+            if (k_scale(q_right) - k_left <= 1.0) {
+                current.mean += (next.mean - current.mean) * next.weight /
+                                (current.weight + next.weight);
+                current.weight += next.weight;
+                continue;
+            }
+            so_far += current.weight;
+            k_left = k_scale(so_far / total);
+            centroids.push_back(current);
+            current = next;
+        }
+        centroids.push_back(current);
+        buffer.clear();
+    }
+
+    double compression;
+    size_t buffer_limit;
+    std::vector<Centroid> centroids, buffer;
+    double total{0.0};
+    double min{std::numeric_limits<double>::infinity()};
+    double max{-std::numeric_limits<double>::infinity()};
+};
+
+/* VaR and ES of a stream of losses at any confidence level */
+struct TailStats {
+    explicit TailStats(double compression = 200) : losses{compression} {}
+
+    void add(double loss) { losses.add(loss); }
+    void merge(const TailStats& other) { losses.merge(other.losses); }
+
+    double get_VaR(double confidence) { return losses.quantile(confidence); }
+    double get_ES(double confidence) { return losses.tail_mean(confidence); }
+    double get_count() const { return losses.get_count(); }
+
+   private:
+    TDigest losses;
+};
@@ -1,3 +1,6 @@
+#include <filesystem>
+#include <random>
+
 #include "risk_system.h"
 
 int main() {
@@ -5,6 +8,16 @@ int main() {
 
     // assume we debug from the build folder where the binary is placed
     RiskManagementSystem<G5> rms("../ref/rates.txt", "../ref/portfolio.txt");
+
+    // Regression checks print their outcome and fail the run (and ctest)
+    int failures{0};
+    auto check = [&failures](bool passed) {
+        Log::print_test_check(passed);
+        failures += !passed;
+    };
+    auto close = [](double a, double b, double rel_tol = 1e-9) {
+        return std::abs(a - b) <= rel_tol * std::max(std::abs(a), std::abs(b));
+    };
 #ifdef DEBUG
     rms.test_debug();
 #endif
@@ -50,4 +63,896 @@ int main() {
     double DV01{rms.get_DV01(USD).value()};
     Log::print_test_name("DV01 for USD:");
     Log::print_test_double(DV01);
-}
\ No newline at end of file
+
+    // The ladder agrees with bumping one tenor at a time
+    auto ladder = rms.get_DV01_ladder(USD).value();
+    std::vector<double> ladder_values;
+    for (auto& [tenor, dv01] : ladder) ladder_values.push_back(dv01);
+    Log::print_test_name("DV01 ladder for USD:");
+    Log::print_test_vector(ladder_values);
+    Log::print_test_name("DV01 ladder matches DV01 for each tenor:");
+    bool ladder_matches{true};
+    for (auto& [tenor, dv01] : ladder) {
+        ladder_matches &= close(dv01, rms.get_DV01(USD, tenor).value(), 1e-6);
+    }
+    check(ladder_matches);
+    Log::print_test_name("DV01 ladder for CAD (no rates):");
+    Log::print_test_double(rms.get_DV01_ladder(CAD).has_value());
+
+    // Analytic derivatives agree with central differences up to O(EPS^2)
+    Log::print_test_name("Analytic DV01 ladder for EUR:");
+    auto analytic = rms.get_DV01_ladder(EUR, SensitivityMethod::Analytic);
+    std::vector<double> analytic_values;
+    for (auto& [tenor, dv01] : analytic.value()) {
+        analytic_values.push_back(dv01);
+    }
+    Log::print_test_vector(analytic_values);
+    Log::print_test_name("Analytic DV01s match central differences:");
+    bool analytic_matches{true};
+    for (auto ccy : {EUR, GBP, USD, JPY}) {
+        auto fd = rms.get_DV01_ladder(ccy).value();
+        auto exact = rms.get_DV01_ladder(ccy, SensitivityMethod::Analytic);
+        for (auto& [tenor, dv01] : exact.value()) {
+            analytic_matches &= close(dv01, fd.at(tenor), 1e-6);
+            analytic_matches &= close(
+                dv01,
+                rms.get_DV01(ccy, tenor, SensitivityMethod::Analytic).value());
+        }
+        analytic_matches &=
+            close(rms.get_DV01(ccy, SensitivityMethod::Analytic).value(),
+                  rms.get_DV01(ccy).value(), 1e-6);
+    }
+    check(analytic_matches);
+
+    // AAD rate sensitivities match the analytic ladders
+    auto gradient = rms.get_PV_gradient();
+    Log::print_test_name("PV of all positions in USD:");
+    Log::print_test_double(gradient.value);
+    Log::print_test_name("AAD PV gradient to FX spots:");
+    std::vector<double> spot_gradient;
+    for (auto& [ccy, g] : gradient.spots) spot_gradient.push_back(g);
+    Log::print_test_vector(spot_gradient);
+    Log::print_test_name("AAD rate gradient matches analytic DV01s:");
+    bool aad_matches{true};
+    for (auto ccy : {EUR, GBP, USD, JPY}) {
+        auto exact = rms.get_DV01_ladder(ccy, SensitivityMethod::Analytic);
+        for (auto& [tenor, dv01] : exact.value()) {
+            double g{gradient.rates.at(ccy).at(tenor)};
+            aad_matches &= close(-g * 1e-4, dv01);
+        }
+    }
+    check(aad_matches);
+
+    // Local DV01s are converted to USD with the JPYUSD spot, not USDJPY: the
+    // inverse would overstate JPY risk by a factor of USDJPY squared
+    Log::print_test_name("JPY DV01 in USD is the local DV01 times JPYUSD:");
+    double jpy_usd_dv01{rms.get_DV01(JPY).value()};
+    rms.set_reporting_currency(JPY);
+    double jpy_local_dv01{rms.get_DV01(JPY).value()};
+    rms.set_reporting_currency(USD);
+    check(close(jpy_usd_dv01,
+                jpy_local_dv01 * rms.get_fx_spot({JPY, USD}).value(), 1e-12) &&
+          std::abs(jpy_usd_dv01) < std::abs(jpy_local_dv01));
+
+    // The parallel runner reproduces the serial bump-and-revalue exactly
+    Log::print_test_name("Parallel DV01 ladders match serial DV01s exactly:");
+    auto ladders = rms.get_DV01_ladders({EUR, GBP, USD, CAD, JPY});
+    bool parallel_matches{!ladders.contains(CAD)};
+    for (auto ccy : {EUR, GBP, USD, JPY}) {
+        for (auto& [tenor, dv01] : ladders.at(ccy)) {
+            parallel_matches &= dv01 == rms.get_DV01(ccy, tenor).value();
+        }
+    }
+    check(parallel_matches);
+
+    // Gamma only couples neighbouring tenors
+    auto gamma = rms.get_gamma_matrix(EUR).value();
+    Log::print_test_name("Gamma matrix diagonal for EUR:");
+    std::vector<double> gamma_diagonal;
+    for (size_t i = 0; i < gamma.tenors.size(); ++i) {
+        gamma_diagonal.push_back(gamma.gamma(i, i));
+    }
+    Log::print_test_vector(gamma_diagonal);
+    Log::print_test_name("Gamma matrix is tridiagonal:");
+    bool tridiagonal{true};
+    for (size_t i = 0; i < gamma.tenors.size(); ++i) {
+        for (size_t k = i + 2; k < gamma.tenors.size(); ++k) {
+            tridiagonal &= gamma.gamma(i, k) == 0.0;
+        }
+    }
+    check(tridiagonal);
+
+    // Analytic gamma matches the four-point stencil on a small grid
+    Log::print_test_name("Analytic gamma matches finite differences:");
+    InterestRates curve;
+    curve.add_rate(30, 0.02);
+    curve.add_rate(360, 0.03);
+    curve.add_rate(1800, 0.04);
+    DateNotionals book;
+    for (int date : {10, 100, 500, 2000}) book.add_trade(date, 1000000);
+    CashflowGrid grid{curve, book};
+    auto exact_gamma = grid.get_gamma(0, grid.size());
+    bool gamma_matches{true};
+    double h{1e-4};
+    for (size_t i = 0; i < grid.tenors.size(); ++i) {
+        for (size_t k = 0; k < grid.tenors.size(); ++k) {
+            auto pv = [&grid, i, k](double h_i, double h_k) {
+                auto r = grid.rates;
+                r[i] += h_i;
+                r[k] += h_k;
+                return grid.get_book_value(r);
+            };
+            double fd{(pv(h, h) - pv(h, -h) - pv(-h, h) + pv(-h, -h)) /
+                      (4 * h * h)};
+            gamma_matches &= std::abs(fd - exact_gamma(i, k)) <=
+                             1e-4 * std::abs(exact_gamma(i, i)) + 1e-6;
+        }
+    }
+    check(gamma_matches);
+
+    // Rolling the grid matches rebuilding it from the rolled cashflows, for
+    // cashflows before the first node, on nodes, between and beyond them
+    Log::print_test_name("Rolled grid PV matches a rebuilt grid:");
+    std::vector<std::pair<int, int>> to_roll{
+        {0, 5},  {1, 7},  {20, 3},   {30, 2},
+        {31, 4}, {360, 6}, {1800, 1}, {2500, 8}};
+    CashflowGrid unrolled{curve, to_roll};
+    bool roll_matches{true};
+    for (int days : {1, 2, 45}) {
+        std::vector<std::pair<int, int>> rolled_cashflows;
+        for (auto [t, notional] : to_roll) {
+            rolled_cashflows.emplace_back(std::max(t - days, 0), notional);
+        }
+        CashflowGrid rebuilt{curve, rolled_cashflows};
+        roll_matches &= close(unrolled.get_rolled_book_value(days),
+                              rebuilt.get_book_value(rebuilt.rates), 1e-14);
+    }
+    check(roll_matches);
+
+    // The zero-to-par Jacobian matches bumping each zero rate in turn
+    Log::print_test_name("Par Jacobian matches finite differences:");
+    InterestRates par_curve;
+    for (auto [tenor, rate] : std::vector<std::pair<int, double>>{
+             {30, 0.02},
+             {180, 0.025},
+             {360, 0.03},
+             {720, 0.035},
+             {1800, 0.04}}) {
+        par_curve.add_rate(tenor, rate);
+    }
+    ParJacobian par{par_curve};
+    size_t n_par{par.tenors.size()};
+    bool jacobian_matches{true};
+    for (size_t k = 0; k < n_par; ++k) {
+        auto par_rates = [&par_curve, &par, k](double bump) {
+            InterestRates bumped{par_curve};
+            bumped.add_rate(par.tenors[k],
+                            par_curve.get_rate(par.tenors[k]) + bump);
+            return ParJacobian{bumped}.par_rates;
+        };
+        auto up = par_rates(1e-6), down = par_rates(-1e-6);
+        for (size_t i = 0; i < n_par; ++i) {
+            double fd{(up[i] - down[i]) / 2e-6};
+            jacobian_matches &=
+                std::abs(fd - par.jacobian[i * n_par + k]) <= 1e-7;
+        }
+    }
+    check(jacobian_matches);
+
+    // A 2Y par swap (receive fixed, pay the notional up front) only has risk
+    // to the 2Y par rate: its PV is N * annuity * (fixed - par)
+    Log::print_test_name(
+        "Par DV01s of a 2Y par swap are in the 2Y bucket only:");
+    int swap_notional{100000000};
+    int coupon{static_cast<int>(std::round(par.par_rates[3] * swap_notional))};
+    CashflowGrid swap{par_curve, std::vector<std::pair<int, int>>{
+                                     {0, -swap_notional},
+                                     {360, coupon},
+                                     {720, swap_notional + coupon}}};
+    std::vector<double> zero_dv01s(n_par);
+    for (size_t k = 0; k < n_par; ++k) {
+        auto r_up = swap.rates, r_down = swap.rates;
+        r_up[k] += 1e-4;
+        r_down[k] -= 1e-4;
+        zero_dv01s[k] =
+            -(swap.get_book_value(r_up) - swap.get_book_value(r_down)) / 2;
+    }
+    auto par_dv01s = par.to_par(zero_dv01s);
+    Log::print_test_vector(par_dv01s);
+    double annuity{std::exp(-0.03) + std::exp(-0.035 * 2)};
+    bool par_matches{close(par_dv01s[3], swap_notional * annuity * 1e-4, 1e-4)};
+    for (size_t i = 0; i < n_par; ++i) {
+        if (i != 3) {
+            par_matches &= std::abs(par_dv01s[i]) <= 1e-4 * par_dv01s[3];
+        }
+    }
+    check(par_matches);
+
+    auto par_ladder = rms.get_par_DV01_ladder(EUR, SensitivityMethod::Analytic);
+    Log::print_test_name("Par-rate DV01 ladder for EUR:");
+    auto par_values = std::views::values(*par_ladder);
+    Log::print_test_vector(
+        std::vector<double>(par_values.begin(), par_values.end()));
+
+    // Standard buckets line up across currencies and keep the total DV01:
+    // EUR's 2M node (60 days) is split evenly between the 1M and 3M buckets
+    Log::print_test_name("EUR DV01 ladder on the standard buckets:");
+    auto eur_nodes =
+        rms.get_DV01_ladder(EUR, SensitivityMethod::Analytic).value();
+    auto eur_buckets =
+        rms.get_bucketed_DV01_ladder(EUR, SensitivityMethod::Analytic).value();
+    auto bucket_values = std::views::values(eur_buckets);
+    Log::print_test_vector(
+        std::vector<double>(bucket_values.begin(), bucket_values.end()));
+    Log::print_test_name("Standard buckets line up and keep the total DV01:");
+    auto total = [](const std::map<int, double>& ladder) {
+        auto v = std::views::values(ladder);
+        return std::reduce(v.begin(), v.end());
+    };
+    auto jpy_buckets = rms.get_bucketed_DV01_ladder(JPY).value();
+    check(std::ranges::equal(std::views::keys(eur_buckets),
+                             std::views::keys(jpy_buckets)) &&
+          close(total(eur_buckets), total(eur_nodes), 1e-12) &&
+          close(total(jpy_buckets), total(rms.get_DV01_ladder(JPY).value()),
+                1e-12) &&
+          close(eur_buckets.at(30), eur_nodes.at(30) + eur_nodes.at(60) / 2,
+                1e-12) &&
+          close(eur_buckets.at(14), eur_nodes.at(7) + eur_nodes.at(14), 1e-12));
+
+    // A tick to one node of an incremental book revalues only the cashflows
+    // next to it, and agrees with a book built from the ticked curve
+    Log::print_test_name("Incremental book matches a rebuild after a tick:");
+    IncrementalBook ticking{CashflowGrid{curve, to_roll}, 1e-4};
+    size_t revalued{ticking.set_rate(1, 0.031)};  // the 360 node
+    InterestRates ticked_curve{curve};
+    ticked_curve.add_rate(360, 0.031);
+    IncrementalBook rebuilt_book{CashflowGrid{ticked_curve, to_roll}, 1e-4};
+    // cashflows at 30, 31 and 360 days: the segments (30, 360) and (360,
+    // 1800). Earlier ones hang on the first node, later ones on the last.
+    check(revalued == 3 &&
+          ticking.get_book_value() == rebuilt_book.get_book_value() &&
+          ticking.get_ladder() == rebuilt_book.get_ladder());
+
+    // All shifts valued in one pass match shifting every node and revaluing
+    Log::print_test_name("Shifted PVs in one pass match bump and revalue:");
+    std::array<double, 3> shifts{-0.02, 1e-4, 0.01};
+    auto shifted = unrolled.get_shifted_book_values(shifts);
+    bool shifts_match{true};
+    for (size_t k = 0; k < shifts.size(); ++k) {
+        auto r = unrolled.rates;
+        for (double& rate : r) rate += shifts[k];
+        shifts_match &= close(shifted[k], unrolled.get_book_value(r), 1e-12);
+    }
+    check(shifts_match);
+
+    // Forward PVs from suffix sums match discounting each remaining cashflow
+    Log::print_test_name("Forward PVs match a direct sum at each horizon:");
+    std::vector<int> horizons{0, 1, 25, 30, 100, 360, 2000, 3000};
+    auto forward_values = unrolled.get_forward_book_values(horizons);
+    bool forwards_match{true};
+    for (size_t k = 0; k < horizons.size(); ++k) {
+        int h{horizons[k]};
+        double direct{0.0};
+        for (auto [t, notional] : to_roll) {
+            if (t > h) {
+                direct += notional * curve.get_discount_factor(t) /
+                          curve.get_discount_factor(h);
+            }
+        }
+        forwards_match &= close(forward_values[k], direct, 1e-12) ||
+                          (direct == 0.0 && forward_values[k] == 0.0);
+    }
+    check(forwards_match);
+
+    // The convexity profile is -DV01 at 1bp and convex in the shift size
+    auto convexity = rms.get_convexity_profile();
+    Log::print_test_name(
+        "EUR PV change for -200, ..., +200bp parallel shifts:");
+    const auto& eur_convexity = convexity.at(EUR).pnl;
+    Log::print_test_vector(
+        std::vector<double>(eur_convexity.begin(), eur_convexity.end()));
+    Log::print_test_name("Convexity profile agrees with the parallel DV01:");
+    bool convex{convexity.size() == 4};
+    for (auto& [ccy, profile] : convexity) {
+        convex &= close(profile.pnl[5], -rms.get_DV01(ccy).value(), 1e-3) &&
+                  profile.pnl[0] + profile.pnl[9] > 0;
+    }
+    check(convex);
+
+    // The exposure profile starts at today's PV and is zero once the last
+    // cashflow is paid (some run past 30 years)
+    auto exposure = rms.get_exposure_profile();
+    Log::print_test_name("EUR expected exposure at 0, 1, 5, 10, 30 years:");
+    const auto& eur_exposure = exposure.at(EUR).exposure;
+    Log::print_test_vector(
+        std::vector<double>{eur_exposure[0], eur_exposure[12], eur_exposure[60],
+                            eur_exposure[120], eur_exposure[360]});
+    Log::print_test_name("Exposure profile starts at the PV and runs off:");
+    bool runs_off{exposure.size() == 4};
+    for (auto& [ccy, profile] : rms.get_exposure_profile(360, 40 * 360)) {
+        runs_off &= profile.exposure.back() == 0.0;
+    }
+    for (auto& [ccy, profile] : exposure) {
+        runs_off &= profile.horizons.size() == 361 &&
+                    close(profile.exposure[0],
+                          rms.get_book_value(ccy).value() *
+                              rms.get_fx_spot({ccy, USD}).value(),
+                          1e-12);
+    }
+    check(runs_off);
+
+    // Cash ladders of every width hold the same cash, and a weekly bucket is
+    // its seven daily buckets
+    auto cash = rms.get_cash_ladders();
+    const auto& eur_monthly = cash.at(EUR)[2];
+    Log::print_test_name(
+        "EUR undiscounted cash in the first 12 monthly buckets:");
+    Log::print_test_vector(
+        std::vector<double>(eur_monthly.undiscounted.begin(),
+                            eur_monthly.undiscounted.begin() + 12));
+    Log::print_test_name("Cash ladders add up across bucket widths:");
+    bool ladders_add_up{cash.size() == 4};
+    for (auto& [ccy, ladders] : cash) {
+        auto& [daily, weekly, monthly] = ladders;
+        double pv{rms.get_book_value(ccy).value()};
+        auto sum = [](const std::vector<double>& v) {
+            return std::reduce(v.begin(), v.end());
+        };
+        for (auto* ladder : {&daily, &weekly, &monthly}) {
+            ladders_add_up &=
+                sum(ladder->undiscounted) == sum(daily.undiscounted) &&
+                close(sum(ladder->discounted), pv, 1e-12);
+        }
+        for (size_t b = 0; b < weekly.starts.size(); ++b) {
+            double days{0.0};
+            size_t end{std::min(7 * b + 7, daily.starts.size())};
+            for (size_t d = 7 * b; d < end; ++d) {
+                days += daily.discounted[d];
+            }
+            ladders_add_up &= close(weekly.discounted[b], days, 1e-12) ||
+                              weekly.discounted[b] == days;
+        }
+    }
+    check(ladders_add_up);
+    Log::print_test_name("A book without cashflows has empty cash ladders:");
+    CashflowGrid no_cashflows{par_curve, std::vector<std::pair<int, int>>{}};
+    bool empty_ladders{true};
+    for (const auto& ladder :
+         no_cashflows.get_cash_ladders(std::array<int, 3>{1, 7, 30})) {
+        empty_ladders &= ladder.starts.empty() &&
+                         ladder.undiscounted.empty() &&
+                         ladder.discounted.empty();
+    }
+    check(empty_ladders);
+
+    // FX delta for a 1% spot move agrees with the AAD spot gradient
+    auto fx_delta = rms.get_FX_delta();
+    Log::print_test_name("FX delta in USD for a 1% move in each spot:");
+    std::vector<double> fx_delta_values;
+    for (auto& [ccy, delta] : fx_delta) fx_delta_values.push_back(delta);
+    Log::print_test_vector(fx_delta_values);
+    Log::print_test_name("FX delta matches the AAD spot gradient:");
+    bool fx_matches{!fx_delta.contains(USD)};
+    for (auto& [ccy, delta] : fx_delta) {
+        double spot{rms.get_fx_spot({ccy, USD}).value()};
+        fx_matches &= close(delta, gradient.spots.at(ccy) * spot * 0.01);
+        fx_matches &=
+            close(delta, rms.get_book_value(ccy).value() * spot * 0.01);
+    }
+    check(fx_matches);
+    Log::print_test_name("FX delta doubles when the USD spot halves:");
+    RiskManagementSystem<G5> usd_moved("../ref/rates.txt",
+                                       "../ref/portfolio.txt");
+    usd_moved.set_spot(USD, 0.5);
+    bool usd_move_matches{true};
+    for (auto& [ccy, delta] : usd_moved.get_FX_delta()) {
+        double spot{usd_moved.get_fx_spot({ccy, USD}).value()};
+        usd_move_matches &=
+            close(delta, usd_moved.get_book_value(ccy).value() * spot * 0.01) &&
+            close(delta, 2 * fx_delta.at(ccy));
+    }
+    check(usd_move_matches);
+
+    // Historical VaR over snapshots that differ from today only by a 1bp
+    // EUR 1Y move up and back down: the worst loss is a 1bp move in the
+    // direction that hurts, i.e. the EUR 1Y DV01 (up to convexity)
+    std::ifstream in_rates{"../ref/rates.txt"};
+    std::vector<std::string> rates_lines;
+    for (std::string line; std::getline(in_rates, line);) {
+        rates_lines.push_back(line);
+    }
+    auto history_dir = std::filesystem::temp_directory_path() / "risk_history";
+    std::filesystem::create_directories(history_dir);
+    auto write_snapshots = [&rates_lines, &history_dir](
+                               size_t days, auto&& move) {
+        std::vector<std::string> paths;
+        for (size_t day = 0; day < days; ++day) {
+            auto path = history_dir / ("rates_" + std::to_string(day) + ".txt");
+            std::ofstream out{path};
+            for (auto& line : rates_lines) out << move(day, line) << "\n";
+            paths.push_back(path.string());
+        }
+        return paths;
+    };
+    auto one_move = write_snapshots(
+        101, [](size_t day, const std::string& line) -> std::string {
+            if (day == 50 && line == "IR.1Y.EUR 0.06") {
+                return "IR.1Y.EUR 0.0601";
+            }
+            return line;
+        });
+    auto var = rms.get_historical_VaR(rms.load_history(one_move), 0.99);
+    Log::print_test_name("Historical VaR and ES for a 1bp EUR 1Y move:");
+    Log::print_test_vector(std::vector<double>{var.VaR, var.ES});
+    Log::print_test_name("Historical VaR matches the EUR 1Y DV01:");
+    check(close(var.VaR, std::abs(rms.get_DV01(EUR, 360).value()), 1e-3) &&
+          var.ES == var.VaR && var.VaR_contributions.at(EUR) == var.VaR);
+
+    // Contributions add up on a noisy history
+    std::mt19937 gen{5226};
+    std::normal_distribution<double> noise{0.0, 1.0};
+    auto noisy = write_snapshots(
+        201, [&gen, &noise](size_t, const std::string& line) -> std::string {
+            std::istringstream s_line{line};
+            std::string key;
+            double value;
+            if (!(s_line >> key >> value)) return line;
+            double move{key.starts_with("FX") ? value * 0.005 * noise(gen)
+                                              : 0.0005 * noise(gen)};
+            return key + " " + std::to_string(std::abs(value + move));
+        });
+    var = rms.get_historical_VaR(rms.load_history(noisy), 0.99, 100);
+    Log::print_test_name("Historical 99% VaR and ES over 100 noisy days:");
+    Log::print_test_vector(std::vector<double>{var.VaR, var.ES});
+    Log::print_test_name("VaR and ES contributions add up:");
+    double var_sum{0.0}, es_sum{0.0};
+    for (auto& [ccy, v] : var.VaR_contributions) var_sum += v;
+    for (auto& [ccy, v] : var.ES_contributions) es_sum += v;
+    check(close(var_sum, var.VaR) && close(es_sum, var.ES) &&
+          var.ES >= var.VaR);
+
+    // Monte Carlo VaR with the noisy history's covariance is reproducible
+    // whatever the number of threads
+    auto covariance = rms.get_covariance(
+        rms.get_historical_scenarios(rms.load_history(noisy)));
+    rms.set_threads(1);
+    auto mc_var = rms.get_MC_VaR(covariance, 20000, 0.99, 42);
+    Log::print_test_name(
+        "Monte Carlo 99% VaR and ES with the noisy covariance:");
+    Log::print_test_vector(std::vector<double>{mc_var.VaR, mc_var.ES});
+    Log::print_test_name("Monte Carlo VaR is the same on 1 and 4 threads:");
+    rms.set_threads(4);
+    auto mc_var_4 = rms.get_MC_VaR(covariance, 20000, 0.99, 42);
+    check(mc_var.VaR == mc_var_4.VaR && mc_var.ES == mc_var_4.ES &&
+          mc_var.VaR_contributions == mc_var_4.VaR_contributions);
+
+    // Explain the P&L from today's market to one noisy day: risk predicts
+    // nearly all of it, and with no move and no roll there is nothing
+    auto day = std::vector<std::string>{noisy.front(), noisy.back()};
+    auto explain = rms.explain_PnL(day[0], day[1]);
+    Log::print_test_name(
+        "EUR P&L explain (rates, gamma, fx, time, unexplained):");
+    const auto& eur_explain = explain.at(EUR);
+    Log::print_test_vector(std::vector<double>{
+        std::reduce(eur_explain.rates.begin(), eur_explain.rates.end()),
+        eur_explain.gamma, eur_explain.fx, eur_explain.time,
+        eur_explain.unexplained});
+    Log::print_test_name("Risk explains the P&L of every currency:");
+    bool explained{explain.size() == 4};
+    for (auto& [ccy, e] : explain) {
+        double size{std::abs(e.gamma) + std::abs(e.fx) + std::abs(e.time)};
+        for (double rate : e.rates) size += std::abs(rate);
+        explained &= std::abs(e.unexplained) <= 1e-2 * size;
+    }
+    auto no_move = rms.explain_PnL(day[0], day[0], 0);
+    for (auto& [ccy, e] : no_move) explained &= e.get_actual() == 0.0;
+    check(explained);
+    Log::print_test_name("A 0D node and a backward roll break no P&L explain:");
+    auto zero_node = write_snapshots(
+        2, [](size_t day, const std::string& line) -> std::string {
+            if (line != "IR.1W.EUR 0.02") return line;
+            return (day == 0 ? "IR.0D.EUR 0.018\n" : "IR.0D.EUR 0.019\n") +
+                   line;
+        });
+    auto zero_explain = rms.explain_PnL(zero_node[0], zero_node[1]).at(EUR);
+    bool zero_node_works{zero_explain.tenors.front() == 0};
+    for (double rate : zero_explain.rates) {
+        zero_node_works &= std::isfinite(rate);
+    }
+    zero_node_works &= std::isfinite(zero_explain.unexplained) &&
+                       rms.explain_PnL(day[0], day[1], -1).empty();
+    check(zero_node_works);
+    std::filesystem::remove_all(history_dir);
+
+    // With 1bp daily vol on EUR 1Y only, 99% VaR is about 2.326 DV01s
+    auto factors = rms.get_risk_factors();
+    SymmetricMatrix one_factor{factors.size()};
+    for (size_t f = 0; f < factors.size(); ++f) {
+        if (factors[f].ccy == EUR && factors[f].tenor == 360) {
+            one_factor(f, f) = 1e-8;
+        }
+    }
+    mc_var = rms.get_MC_VaR({factors, one_factor}, 20000, 0.99);
+    Log::print_test_name("Monte Carlo VaR for 1bp EUR 1Y vol is 2.326 DV01s:");
+    check(close(mc_var.VaR, 2.326 * std::abs(rms.get_DV01(EUR, 360).value()),
+                0.05));
+
+    // Stresses: FX is linear in spot, and +200bp loses less than 200 DV01s
+    auto stresses = rms.run_stresses(rms.load_stresses("../ref/stresses.txt"));
+    Log::print_test_name("Stress P&L by scenario (rows) and currency:");
+    for (size_t row = 0; row < stresses.scenarios.size(); ++row) {
+        std::vector<double> pnl_row;
+        for (size_t col = 0; col < stresses.currencies.size(); ++col) {
+            pnl_row.push_back(stresses.at(row, col));
+        }
+        Log::print_test_name(stresses.scenarios[row]);
+        Log::print_test_vector(pnl_row);
+    }
+    Log::print_test_name("Stress P&L is consistent with DV01 and FX delta:");
+    bool stresses_match{stresses.scenarios.size() == 6};
+    for (size_t col = 0; col < stresses.currencies.size(); ++col) {
+        auto ccy = stresses.currencies[col];
+        double dv01{rms.get_DV01(ccy).value()};
+        stresses_match &= stresses.at(0, col) < 0 &&
+                          stresses.at(0, col) >= -200 * dv01;
+        double fx{ccy == USD ? 0.0 : 25 * fx_delta.at(ccy)};
+        stresses_match &= close(stresses.at(4, col), fx) || fx == 0.0;
+        stresses_match &= close(stresses.at(5, col), -fx) || fx == 0.0;
+    }
+    check(stresses_match);
+
+    // IRRBB twists scale the USD base shocks of 300bp (short) and 150bp (long)
+    Log::print_test_name(
+        "Steepener and flattener are -195/+135bp and +240/-90bp:");
+    auto irrbb = rms.load_stresses("../ref/stresses.txt");
+    auto in_bp = StressScenario::parse("TWIST_BP TWIST -195 135");
+    check(irrbb[2].short_bp == -195 && irrbb[2].long_bp == 135 &&
+          irrbb[3].short_bp == 240 && irrbb[3].long_bp == -90 &&
+          in_bp && in_bp->short_bp == -195 && in_bp->long_bp == 135 &&
+          !StressScenario::parse("BAD TWIST -0.65 0.9 300"));
+
+    // Delta-normal VaR is close to Monte Carlo VaR for the same covariance,
+    // and its contributions add up
+    auto loaded = rms.load_covariance("../ref/covariance.txt");
+    rms.set_parametric_covariance(loaded);
+    auto normal_var = rms.get_parametric_VaR(0.99);
+    auto loaded_mc_var = rms.get_MC_VaR(loaded, 50000, 0.99);
+    Log::print_test_name("Delta-normal and Monte Carlo 99% VaR:");
+    Log::print_test_vector(
+        std::vector<double>{normal_var.VaR, loaded_mc_var.VaR});
+    Log::print_test_name("Delta-normal VaR is close to Monte Carlo VaR:");
+    double normal_sum{0.0};
+    for (auto& [ccy, v] : normal_var.VaR_contributions) normal_sum += v;
+    check(close(normal_var.VaR, loaded_mc_var.VaR, 0.05) &&
+          close(normal_sum, normal_var.VaR));
+
+    // Delta-normal VaR stays in USD whatever the reporting currency
+    Log::print_test_name(
+        "Delta-normal VaR is the same reporting in USD and EUR:");
+    rms.set_reporting_currency(EUR);
+    rms.set_parametric_covariance(loaded);
+    auto eur_reported_var = rms.get_parametric_VaR(0.99);
+    rms.set_reporting_currency(USD);
+    check(close(eur_reported_var.VaR, normal_var.VaR, 1e-12) &&
+          close(eur_reported_var.VaR_contributions.at(JPY),
+                normal_var.VaR_contributions.at(JPY), 1e-12));
+
+    // Incremental updates agree with recomputing from scratch
+    Log::print_test_name("Incremental delta-normal update matches full:");
+    SymmetricMatrix small{3};
+    small(0, 0) = 4.0;
+    small(1, 0) = 1.0;
+    small(1, 1) = 2.0;
+    small(2, 1) = -0.5;
+    small(2, 2) = 3.0;
+    DeltaNormalVaR incremental{small}, full{small};
+    incremental.set_sensitivities(0, {1.0, 2.0, 3.0});
+    incremental.set_sensitivities(1, {-1.0, 0.5});
+    full.set_sensitivities(0, {1.0, -1.0, 0.5});
+    check(close(incremental.get_variance(), full.get_variance(), 1e-12) &&
+          std::abs(inverse_normal_cdf(0.99) - 2.3263478740408408) < 1e-12);
+
+    // Rate, trade and spot updates refresh delta-normal VaR as they land
+    Log::print_test_name("Delta-normal VaR after updates matches a fresh one:");
+    RiskManagementSystem<G5> ticked("../ref/rates.txt", "../ref/portfolio.txt");
+    ticked.set_parametric_covariance(loaded);
+    bool ticks_match{true};
+    auto tick_matches = [&ticked, &loaded, &close](double before) {
+        double incremental_var{ticked.get_parametric_VaR(0.99).VaR};
+        ticked.set_parametric_covariance(loaded);
+        return incremental_var != before &&
+               close(incremental_var, ticked.get_parametric_VaR(0.99).VaR,
+                     1e-12);
+    };
+    ticked.add_rate(EUR, 360, 0.03);
+    ticks_match &= tick_matches(normal_var.VaR);
+    double before{ticked.get_parametric_VaR(0.99).VaR};
+    ticked.add_trade(GBP, 43000, 100000000);
+    ticks_match &= tick_matches(before);
+    before = ticked.get_parametric_VaR(0.99).VaR;
+    ticked.set_spot(EUR, 1.2);
+    ticks_match &= tick_matches(before);
+    before = ticked.get_parametric_VaR(0.99).VaR;
+    ticked.set_spot(USD, 0.5);
+    ticks_match &= tick_matches(before);
+    check(ticks_match);
+
+    // t-digests of normal samples merged from 4 partial streams match the
+    // exact normal VaR and ES at several confidence levels
+    std::vector<TailStats> partials(4);
+    for (size_t n = 0; n < 400000; ++n) {
+        partials[n % 4].add(CounterRNG{1, n % 4}.normal(n));
+    }
+    TailStats merged;
+    for (auto& partial : partials) merged.merge(partial);
+    Log::print_test_name("t-digest VaR and ES of N(0, 1) at 95%, 99%, 99.9%:");
+    std::vector<double> digest_values;
+    bool digest_matches{merged.get_count() == 400000};
+    for (double confidence : {0.95, 0.99, 0.999}) {
+        double z{inverse_normal_cdf(confidence)};
+        double es{std::exp(-z * z / 2) / std::sqrt(2 * std::numbers::pi) /
+                  (1 - confidence)};
+        digest_values.push_back(merged.get_VaR(confidence));
+        digest_values.push_back(merged.get_ES(confidence));
+        digest_matches &= close(merged.get_VaR(confidence), z, 0.02) &&
+                          close(merged.get_ES(confidence), es, 0.02);
+    }
+    Log::print_test_vector(digest_values);
+    Log::print_test_name("t-digest VaR and ES match the normal distribution:");
+    check(digest_matches);
+
+    // The Monte Carlo t-digest agrees with the exact tail
+    auto mc_tail = rms.get_MC_tail_stats(loaded, 50000);
+    Log::print_test_name(
+        "Monte Carlo t-digest VaR and ES match the exact tail:");
+    check(close(mc_tail.get_VaR(0.99), loaded_mc_var.VaR, 0.01) &&
+          close(mc_tail.get_ES(0.99), loaded_mc_var.ES, 0.01));
+
+    // Absolute bump schemes estimate the same DV01, one-sided ones to first
+    // order in the bump size and central ones to second order; a relative
+    // scheme estimates the DV01 times the node rate
+    Log::print_test_name(
+        "EUR 1Y DV01, forward/backward/relative/large central:");
+    auto fd = SensitivityMethod::CentralDifference;
+    std::vector<double> scheme_dv01s{
+        rms.get_DV01(EUR, 360, fd, {BumpDirection::Forward}).value(),
+        rms.get_DV01(EUR, 360, fd, {BumpDirection::Backward}).value(),
+        rms.get_DV01(EUR, 360, fd, {BumpDirection::Central, 1e-2, true})
+            .value(),
+        rms.get_DV01(EUR, 360, fd, {BumpDirection::Central, 1e-3}).value()};
+    Log::print_test_vector(scheme_dv01s);
+    Log::print_test_name("Bump schemes agree with the analytic DV01:");
+    auto exact = SensitivityMethod::Analytic;
+    double eur_exact{rms.get_DV01(EUR, 360, exact).value()};
+    double eur_exact_parallel{rms.get_DV01(EUR, exact).value()};
+    double eur_1y_node{std::log(1 / rms.get_discount_factor(EUR, 360).value())};
+    check(close(scheme_dv01s[0], eur_exact, 1e-3) &&
+          close(scheme_dv01s[1], eur_exact, 1e-3) &&
+          // a relative bump of EPS moves the node by EPS * rate
+          close(scheme_dv01s[2], eur_exact * eur_1y_node, 1e-4) &&
+          close(scheme_dv01s[3], eur_exact, 1e-4) &&
+          close(rms.get_DV01(EUR, fd, {BumpDirection::Forward}).value(),
+                eur_exact_parallel, 1e-3));
+    Log::print_test_name("Zero, negative and infinite bump sizes are refused:");
+    bool bad_sizes_refused{true};
+    for (double size : {0.0, -1e-4, std::numeric_limits<double>::infinity(),
+                        std::numeric_limits<double>::quiet_NaN()}) {
+        bad_sizes_refused &=
+            !rms.get_DV01(EUR, 360, fd, {BumpDirection::Central, size}) &&
+            !rms.get_DV01(EUR, fd, {BumpDirection::Forward, size});
+    }
+    check(bad_sizes_refused);
+
+    double rms_gbp_dv01{rms.get_DV01(GBP).value()};
+
+    // A batch of queries with duplicates and invalid entries agrees with
+    // the one-by-one API, whatever the number of threads
+    using Query = RiskManagementSystem<G5>::RiskQuery;
+    using Kind = RiskManagementSystem<G5>::QueryKind;
+    std::vector<Query> queries;
+    for (int repeat = 0; repeat < 3; ++repeat) {
+        for (auto ccy : {EUR, GBP, USD, JPY, CAD}) {
+            queries.push_back({Kind::DiscountFactor, ccy, 45});
+            queries.push_back({Kind::ParallelDV01, ccy});
+            queries.push_back({Kind::PV, ccy});
+            queries.push_back({Kind::DV01, ccy, 360});
+            queries.push_back({Kind::DV01, ccy, 361});  // not a node
+        }
+    }
+    auto answers = rms.run_queries(queries);
+    auto book_values = rms.get_book_values();
+    rms.set_threads(1);
+    bool batch_matches{answers == rms.run_queries(queries)};
+    rms.set_threads(4);
+    for (size_t q = 0; q < queries.size(); ++q) {
+        auto [kind, ccy, tenor] = queries[q];
+        const auto& answer = answers[q];
+        if (ccy == CAD || (kind == Kind::DV01 && tenor == 361)) {
+            batch_matches &= !answer.has_value();
+        } else if (kind == Kind::DiscountFactor) {
+            batch_matches &= answer == rms.get_discount_factor(ccy, tenor);
+        } else if (kind == Kind::ParallelDV01) {
+            batch_matches &= close(*answer, rms.get_DV01(ccy).value(), 1e-9);
+        } else if (kind == Kind::PV) {
+            batch_matches &= close(*answer, book_values.at(ccy), 1e-12);
+        } else {
+            batch_matches &=
+                close(*answer, rms.get_DV01(ccy, tenor).value(), 1e-6);
+        }
+    }
+    Log::print_test_name("Batched queries match one-by-one queries:");
+    check(batch_matches);
+
+    // 1-day theta and carry per currency, the same on any number of threads
+    auto theta = rms.get_theta();
+    Log::print_test_name("1-day theta, carry in USD for EUR, GBP, JPY, USD:");
+    std::vector<double> theta_values;
+    for (auto& [ccy, tc] : theta) {
+        theta_values.push_back(tc.theta);
+        theta_values.push_back(tc.carry);
+    }
+    Log::print_test_vector(theta_values);
+    Log::print_test_name("Theta and carry do not depend on the thread count:");
+    bool theta_matches{theta.size() == 4};
+    rms.set_threads(1);
+    auto serial_theta = rms.get_theta(1);
+    rms.set_threads(4);
+    for (auto& [ccy, tc] : serial_theta) {
+        theta_matches &= theta.contains(ccy) &&
+                         theta.at(ccy).theta == tc.theta &&
+                         theta.at(ccy).carry == tc.carry;
+    }
+    check(theta_matches);
+    Log::print_test_name("Theta refuses to roll the date backwards:");
+    check(rms.get_theta(-300).empty());
+
+    // Reporting in EUR divides every USD sensitivity by the EURUSD spot
+    Log::print_test_name("Book values in EUR:");
+    rms.set_reporting_currency(EUR);
+    auto eur_values = rms.get_book_values();
+    auto eur_values_v = std::views::values(eur_values);
+    Log::print_test_vector(
+        std::vector<double>(eur_values_v.begin(), eur_values_v.end()));
+    double eurusd{rms.get_fx_spot({EUR, USD}).value()};
+    bool reported{
+        close(rms.get_DV01(GBP).value(), rms_gbp_dv01 / eurusd, 1e-12) &&
+        close(eur_values.at(EUR), rms.get_book_value(EUR).value(), 1e-12) &&
+        close(eur_values.at(JPY),
+              rms.get_book_value(JPY).value() *
+                  rms.get_fx_spot({JPY, EUR}).value(),
+              1e-12)};
+    rms.set_reporting_currency(USD);
+    reported &= rms.get_DV01(GBP).value() == rms_gbp_dv01;
+    Log::print_test_name("Sensitivities are reported in the chosen currency:");
+    check(reported);
+
+    // Cached DV01s are recomputed exactly when their inputs change. Use a
+    // separate system so updates do not leak into the other tests.
+    RiskManagementSystem<G5> live("../ref/rates.txt", "../ref/portfolio.txt");
+    double eur_dv01{live.get_DV01(EUR).value()};
+    double eur_1y{live.get_DV01(EUR, 360).value()};
+    double eur_1y_rate{
+        std::log(1 / live.get_discount_factor(EUR, 360).value())};
+    double eur_spot{live.get_fx_spot({EUR, USD}).value()};
+    Log::print_test_name("Repeat DV01 queries return the cached result:");
+    check(live.get_DV01(EUR).value() == eur_dv01 &&
+          live.get_DV01(EUR, 360).value() == eur_1y);
+    live.add_rate(EUR, 360, eur_1y_rate + 0.01);
+    bool cache_updates{live.get_DV01(EUR, 360).value() != eur_1y};
+    live.add_rate(EUR, 360, eur_1y_rate);
+    cache_updates &= close(live.get_DV01(EUR, 360).value(), eur_1y, 1e-12);
+    live.set_spot(EUR, 2 * eur_spot);
+    cache_updates &= close(live.get_DV01(EUR).value(), 2 * eur_dv01, 1e-12);
+    live.set_spot(EUR, eur_spot);
+    live.add_trade(GBP, 43000, 1000000);
+    cache_updates &= live.get_DV01(EUR).value() == eur_dv01;
+    live.add_trade(EUR, 43000, 1000000);
+    cache_updates &= live.get_DV01(EUR).value() != eur_dv01;
+    Log::print_test_name("Rate, spot and trade updates invalidate the cache:");
+    check(cache_updates);
+
+    // Live risk follows rate, spot and trade updates
+    auto live_risk = live.get_live_risk(EUR).value();
+    live.add_rate(EUR, 720, 0.071);
+    live.set_spot(EUR, 1.2);
+    live.add_trade(GBP, 43000, 1000000);
+    live_risk = live.get_live_risk(EUR).value();
+    auto live_ladder =
+        live.get_DV01_ladder(EUR, SensitivityMethod::Analytic).value();
+    bool live_matches{
+        close(live_risk.PV, live.get_book_value(EUR).value() * 1.2, 1e-12)};
+    for (auto& [tenor, dv01] : live_ladder) {
+        live_matches &= close(live_risk.ladder.at(tenor), dv01, 1e-12);
+    }
+    live.add_trade(EUR, 43500, 1000000);
+    live.add_rate(EUR, 4000, 0.16);
+    live_matches &= close(live.get_live_risk(EUR)->PV,
+                          live.get_book_value(EUR).value() * 1.2, 1e-12);
+    // a trade on a new date and one on an existing date, with no new node
+    live.add_trade(EUR, 43333, -2000000);
+    live.add_trade(EUR, 43500, 500000);
+    live_risk = live.get_live_risk(EUR).value();
+    live_ladder =
+        live.get_DV01_ladder(EUR, SensitivityMethod::Analytic).value();
+    live_matches &=
+        close(live_risk.PV, live.get_book_value(EUR).value() * 1.2, 1e-12);
+    for (auto& [tenor, dv01] : live_ladder) {
+        live_matches &= close(live_risk.ladder.at(tenor), dv01, 1e-12);
+    }
+    Log::print_test_name("Live risk follows rate, spot and trade updates:");
+    check(live_matches);
+
+    // Limits are checked after every update and report each breach once
+    RiskManagementSystem<G5> limited("../ref/rates.txt",
+                                     "../ref/portfolio.txt");
+    using Breach = RiskManagementSystem<G5>::LimitBreach;
+    std::vector<Breach> breaches;
+    limited.set_limit_callback(
+        [&breaches](const Breach& b) { breaches.push_back(b); });
+    auto eur_live = limited.get_live_risk(EUR).value();
+    limited.set_DV01_limit(EUR, 360, std::abs(eur_live.ladder.at(360)) * 1.01);
+    limited.set_PV_limit(EUR, std::abs(eur_live.PV) * 1.5);
+    limited.set_DV01_limit(GBP, 720, 1e12);
+    bool limits_work{limited.check_limits(EUR) == 0 && breaches.empty() &&
+                     !limited.set_DV01_limit(EUR, 361, 1.0)};
+    limited.add_rate(EUR, 360, 0.03);  // 1Y down 3%: the 1Y DV01 grows
+    limits_work &= breaches.size() == 1 && breaches[0].ccy == EUR &&
+                   breaches[0].tenor == 360 &&
+                   breaches[0].value ==
+                       limited.get_live_risk(EUR)->ladder.at(360);
+    limited.set_spot(USD, 0.5);  // everything doubles in USD terms
+    limits_work &= breaches.size() == 3 &&
+                   breaches[1].tenor == limited.PV_LIMIT &&
+                   breaches[2].tenor == 360;
+    Log::print_test_name(
+        "DV01 and PV limits fire on the updates that breach them:");
+    check(limits_work);
+
+    // Jobs can fork and join more jobs on the same pool without deadlocking
+    // it, even on one worker, and the first exception of a batch is rethrown
+    Log::print_test_name("Nested fork-join on 1 and 3 workers sums 0..9999:");
+    bool fork_join_works{true};
+    for (size_t n_workers : {1, 3}) {
+        ThreadPool pool{n_workers};
+        auto sums = pool.parallel_map(10, [&pool](size_t i) {
+            auto parts = pool.parallel_map(
+                1000, [i](size_t j) { return i * 1000 + j; });
+            return std::reduce(parts.begin(), parts.end());
+        });
+        auto future = pool.submit(
+            [&sums] { return std::reduce(sums.begin(), sums.end()); });
+        fork_join_works &= pool.join(future) == 9999 * 10000 / 2;
+        try {
+            pool.parallel_for(8, [](size_t i) {
+                if (i == 5) throw std::runtime_error{"job 5"};
+            });
+            fork_join_works = false;
+        } catch (const std::runtime_error&) {
+        }
+    }
+    check(fork_join_works);
+
+    // A system on pinned workers loads and values the same book
+    Log::print_test_name("Pinned workers give the same gamma and stresses:");
+    RiskManagementSystem<G5> pinned("../ref/rates.txt", "../ref/portfolio.txt",
+                                    2, true);
+    auto stress_file = rms.load_stresses("../ref/stresses.txt");
+    bool pinned_matches{pinned.run_stresses(stress_file).pnl ==
+                        rms.run_stresses(stress_file).pnl};
+    auto pinned_gamma = pinned.get_gamma_matrix(EUR).value();
+    auto rms_gamma = rms.get_gamma_matrix(EUR).value();
+    for (size_t i = 0; i < rms_gamma.tenors.size(); ++i) {
+        for (size_t k = 0; k <= i; ++k) {
+            pinned_matches &= pinned_gamma.gamma(i, k) == rms_gamma.gamma(i, k);
+        }
+    }
+    check(pinned_matches);
+
+    // Trade lines parsed on one worker or many are booked the same
+    Log::print_test_name("One worker loads the same books as many:");
+    RiskManagementSystem<G5> serial("../ref/rates.txt", "../ref/portfolio.txt",
+                                    1);
+    check(serial.get_book_values() == rms.get_book_values());
+
+    return failures;
+}
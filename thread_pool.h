@@ -0,0 +1,207 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>  // pthread_setaffinity_np
+#endif
+
+/*
+    A fixed-size pool of worker threads with a work-stealing scheduler. Each
+    worker owns a deque of jobs: it runs its newest job first (so jobs forked
+    by a job stay on the same, cache-warm core) and, when its deque is empty,
+    steals the oldest job of another worker. Jobs submitted from outside the
+    pool are dealt round-robin.
+    - submit() returns a future for the job's result, and join() waits for it
+    - parallel_for() and parallel_map() fork n jobs and join them
+    A joining thread runs queued jobs while it waits, so fork-join calls can
+    be nested inside jobs without deadlocking the pool. Workers can be pinned
+    to one core each (on Linux only). The pool finishes all queued jobs before
+    its destructor joins the workers.
+*/
+class ThreadPool {
+   public:
+    explicit ThreadPool(size_t n_threads = std::thread::hardware_concurrency(),
+                        bool pin = false) {
+        n_threads = std::max<size_t>(n_threads, 1);  // 0 if unknown
+        for (size_t i = 0; i < n_threads; ++i) {
+            queues.push_back(std::make_unique<Queue>());
+        }
+        workers.reserve(n_threads);
+        for (size_t i = 0; i < n_threads; ++i) {
+            workers.emplace_back([this, i] { work(i); });
+        }
+        pinned = pin && pin_workers();
+    }
+    ~ThreadPool() {
+        {
+            std::scoped_lock lock{sleep_mutex};
+            stopping = true;
+        }
+        ready.notify_all();
+        // std::jthread joins on destruction
+    }
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    template <typename F>
+    std::future<std::invoke_result_t<F>> submit(F&& f) {
+        // std::function must be copyable but packaged_task is move-only
+        using R = std::invoke_result_t<F>;
+        auto task =
+            std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+        auto result = task->get_future();
+        push([task] { (*task)(); });
+        return result;
+    }
+
+    // RETURNS the result of a submitted job, running queued jobs until it is
+    // ready
+    template <typename T>
+    T join(std::future<T>& result) {
+        while (result.wait_for(std::chrono::seconds{0}) !=
+               std::future_status::ready) {
+            if (!run_one()) std::this_thread::yield();
+        }
+        return result.get();
+    }
+
+    // Run f(i) for i in [0, n) as n jobs and wait for all of them. The first
+    // exception thrown by a job is rethrown once they are all done.
+    template <typename F>
+    void parallel_for(size_t n, F&& f) {
+        std::atomic<size_t> remaining{n};
+        std::exception_ptr error;
+        std::mutex error_mutex;
+        for (size_t i = 0; i < n; ++i) {
+            push([&f, &remaining, &error, &error_mutex, i] {
+                try {
+                    f(i);
+                } catch (...) {
+                    std::scoped_lock lock{error_mutex};
+                    if (!error) error = std::current_exception();
+                }
+                remaining.fetch_sub(1, std::memory_order_release);
+            });
+        }
+        while (remaining.load(std::memory_order_acquire) > 0) {
+            if (!run_one()) std::this_thread::yield();
+        }
+        if (error) std::rethrow_exception(error);
+    }
+
+    // RETURNS f(0), ..., f(n - 1), each computed by its own job
+    template <typename F>
+    auto parallel_map(size_t n, F&& f) {
+        using R = std::invoke_result_t<F&, size_t>;
+        std::vector<std::optional<R>> slots(n);
+        parallel_for(n, [&f, &slots](size_t i) { slots[i].emplace(f(i)); });
+        std::vector<R> results;
+        results.reserve(n);
+        for (auto& slot : slots) results.push_back(std::move(*slot));
+        return results;
+    }
+
+    size_t size() const { return workers.size(); }
+    bool is_pinned() const { return pinned; }
+
+   private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> jobs;
+    };
+
+    void push(std::function<void()> job) {
+        size_t i{owner == this ? home
+                               : next.fetch_add(1, std::memory_order_relaxed) %
+                                     queues.size()};
+        {
+            // counted first, so pending never drops below the visible jobs,
+            // and under the sleep mutex, so no sleeping worker misses it
+            std::scoped_lock lock{sleep_mutex};
+            ++pending;
+        }
+        {
+            std::scoped_lock lock{queues[i]->mutex};
+            queues[i]->jobs.push_back(std::move(job));
+        }
+        ready.notify_one();
+    }
+
+    // Run the newest job of the calling worker's deque or else steal the
+    // oldest job of another deque. RETURNS false if all deques were empty.
+    bool run_one() {
+        bool is_worker{owner == this};
+        size_t first{is_worker ? home : 0};
+        std::function<void()> job;
+        for (size_t k = 0; k < queues.size() && !job; ++k) {
+            auto& queue = *queues[(first + k) % queues.size()];
+            std::scoped_lock lock{queue.mutex};
+            if (queue.jobs.empty()) continue;
+            if (is_worker && k == 0) {
+                job = std::move(queue.jobs.back());
+                queue.jobs.pop_back();
+            } else {
+                job = std::move(queue.jobs.front());
+                queue.jobs.pop_front();
+            }
+        }
+        if (!job) return false;
+        --pending;
+        job();
+        return true;
+    }
+
+    void work(size_t index) {
+        owner = this;
+        home = index;
+        while (true) {
+            if (run_one()) continue;
+            std::unique_lock lock{sleep_mutex};
+            ready.wait(lock, [this] { return stopping || pending > 0; });
+            if (stopping && pending == 0) return;  // stopping and drained
+        }
+    }
+
+    // Pin worker i to core i (modulo the number of cores). RETURNS false if
+    // pinning is unsupported or refused.
+    bool pin_workers() {
+#ifdef __linux__
+        size_t n_cores{std::max(std::thread::hardware_concurrency(), 1u)};
+        bool all_pinned{true};
+        for (size_t i = 0; i < workers.size(); ++i) {
+            cpu_set_t cores;
+            CPU_ZERO(&cores);
+            CPU_SET(i % n_cores, &cores);
+            all_pinned &= pthread_setaffinity_np(workers[i].native_handle(),
+                                                 sizeof(cores), &cores) == 0;
+        }
+        return all_pinned;
+#else
+        return false;
+#endif
+    }
+
+    // The pool and deque index of the calling thread, if it is a worker
+    static inline thread_local ThreadPool* owner{nullptr};
+    static inline thread_local size_t home{0};
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::atomic<size_t> next{0};     // deque of the next outside job
+    std::atomic<size_t> pending{0};  // jobs pushed but not yet taken
+    std::mutex sleep_mutex;
+    std::condition_variable ready;
+    bool stopping{false};
+    bool pinned{false};
+    std::vector<std::jthread> workers;  // last, so it is destroyed first
+};